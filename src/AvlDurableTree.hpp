@@ -0,0 +1,570 @@
+/**
+ * Author: Alin Tomescu
+ * Website: http://alinush.is-great.org
+ */
+
+#pragma once
+
+#include <Core.hpp>
+
+#include <AvlTree.hpp>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <unistd.h>
+
+/**
+ *	The lookup table of avlCrc32, one entry per byte value.
+ */
+class AvlCrc32Table
+{
+    public:
+        AvlCrc32Table()
+        {
+            for(uint32_t i = 0; i < 256; i++)
+            {
+                uint32_t c = i;
+                for(int k = 0; k < 8; k++)
+                    c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+                entries[i] = c;
+            }
+        }
+
+    public:
+        uint32_t entries[256];
+};
+
+/**
+ *	Computes the CRC-32 (IEEE 802.3) checksum of the buffer, continuing from
+ *	the specified checksum. The table is built by the first call, and C++11
+ *	makes that safe when several threads make it at once.
+ */
+inline uint32_t avlCrc32(const void * data, size_t length, uint32_t crc = 0)
+{
+    static const AvlCrc32Table table;
+
+    const unsigned char * bytes = static_cast<const unsigned char *>(data);
+
+    crc = ~crc;
+    for(size_t i = 0; i < length; i++)
+        crc = table.entries[(crc ^ bytes[i]) & 0xFF] ^ (crc >> 8);
+
+    return ~crc;
+}
+
+/**
+ *	An AvlTree whose inserts and removes survive crashes. Every operation is
+ *	appended to a checksummed write-ahead log (WAL), and the log is written and
+ *	fsync'ed once per group of operations (group commit), so an operation is
+ *	durable once its group is committed. Every so often a checkpoint with the
+ *	full contents of the tree is written and the log starts over.
+ *
+ *	The directory holds "checkpoint-N", the image of the tree after checkpoint
+ *	N, and "wal-N", the operations that followed it. A new checkpoint is renamed
+ *	into place atomically before the previous files are deleted, so a crash at
+ *	any point leaves one consistent (checkpoint, log) pair behind.
+ *
+ *	On recovery, the log is read up to the first torn or corrupted record, sorted
+ *	by key, merged with the checkpoint and loaded with AvlTree::assignSorted,
+ *	instead of being replayed one insert at a time.
+ *
+ *	Keys and values are written as raw bytes, so they must be trivially copyable.
+ */
+template<class Key, class Value, class Compare = std::less<Key>, class Augment = AvlNoAugment>
+class AvlDurableTree
+{
+    public:
+        typedef AvlTree<Key, Value, Compare, Augment> Tree;
+        typedef AvlEntry<Key, Value> Entry;
+
+    private:
+        enum { INSERT = 1, REMOVE = 2 };
+        enum { CHECKPOINT_MAGIC = 0x41564c43 };
+
+        static_assert(std::is_trivially_copyable<Key>::value, "AvlDurableTree keys must be trivially copyable");
+        static_assert(std::is_trivially_copyable<Value>::value, "AvlDurableTree values must be trivially copyable");
+
+        /**
+         *	A log record is the type, the key, the value and the CRC-32 of the three.
+         */
+        static const size_t RECORD_SIZE = 1 + sizeof(Key) + sizeof(Value) + sizeof(uint32_t);
+
+    public:
+        /**
+         *	Opens (or creates) the tree stored in the specified directory, which
+         *	must exist. Operations are committed in groups of groupSize and a
+         *	checkpoint is taken every checkpointInterval operations.
+         */
+        AvlDurableTree(const std::string& dir, unsigned int groupSize = 64, unsigned long checkpointInterval = 1 << 20)
+            :	_dir(dir), _groupSize(groupSize ? groupSize : 1), _checkpointInterval(checkpointInterval),
+                _generation(0), _latest(0), _walFd(-1), _pending(0), _logged(0)
+        {
+            recover();
+        }
+
+        AvlDurableTree(const AvlDurableTree&) = delete;
+        AvlDurableTree& operator=(const AvlDurableTree&) = delete;
+
+        ~AvlDurableTree()
+        {
+            try
+            {
+                commit();
+            }
+            catch(std::exception * e)
+            {
+                logerror << "Could not commit the log of " << _dir << ": " << e->what() << std::endl;
+                delete e;
+            }
+
+            if(_walFd != -1)
+                ::close(_walFd);
+        }
+
+    public:
+        void insert(const Key& key, const Value& value)
+        {
+            _tree.insert(key, value);
+            log(INSERT, key, value);
+        }
+
+        /**
+         *	Removes the oldest value of the key, like AvlTree::remove.
+         */
+        Value remove(const Key& key)
+        {
+            Value value = _tree.remove(key);
+            log(REMOVE, key, value);
+            return value;
+        }
+
+        const Value * find(const Key& key) { return _tree.find(key); }
+
+        unsigned long size() const { return _tree.size(); }
+
+        /**
+         *	The tree must only be modified through this class, or the changes
+         *	will not be logged.
+         */
+        const Tree& tree() const { return _tree; }
+
+        /**
+         *	Writes the pending log records and waits for them to reach the disk.
+         */
+        void commit()
+        {
+            if(_buffer.empty())
+                return;
+
+            writeAll(_walFd, _buffer.data(), _buffer.size(), "write-ahead log");
+
+            if(::fdatasync(_walFd) != 0)
+                fail("Could not sync the write-ahead log");
+
+            _buffer.clear();
+            _pending = 0;
+        }
+
+        /**
+         *	Writes the full contents of the tree to a new checkpoint and starts a
+         *	new, empty log.
+         */
+        void checkpoint()
+        {
+            commit();
+
+            std::vector<char> image(sizeof(uint32_t) + sizeof(uint64_t));
+            uint32_t magic = CHECKPOINT_MAGIC;
+            uint64_t count = _tree.size();
+            memcpy(image.data(), &magic, sizeof(magic));
+            memcpy(image.data() + sizeof(magic), &count, sizeof(count));
+
+            image.reserve(image.size() + count * (sizeof(Key) + sizeof(Value)) + sizeof(uint32_t));
+            for(const typename Tree::Node * it = _tree.getLeftmost(); it; it = it->getNext())
+            {
+                append(image, &it->entry.key, sizeof(Key));
+                append(image, &it->entry.value, sizeof(Value));
+            }
+
+            uint32_t crc = avlCrc32(image.data(), image.size());
+            append(image, &crc, sizeof(crc));
+
+            std::string tmp = path("checkpoint.tmp");
+            int fd = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+            if(fd == -1)
+                fail("Could not create " + tmp);
+
+            writeAll(fd, image.data(), image.size(), "checkpoint");
+            if(::fsync(fd) != 0)
+            {
+                ::close(fd);
+                fail("Could not sync " + tmp);
+            }
+            ::close(fd);
+
+            unsigned long previous = _generation;
+            _generation = ++_latest;
+            if(::rename(tmp.c_str(), file("checkpoint-", _generation).c_str()) != 0)
+                fail("Could not rename " + tmp);
+
+            openLog(O_TRUNC);
+            syncDir();
+
+            ::unlink(file("wal-", previous).c_str());
+            ::unlink(file("checkpoint-", previous).c_str());
+            _logged = 0;
+        }
+
+    private:
+        void log(unsigned char type, const Key& key, const Value& value)
+        {
+            size_t start = _buffer.size();
+
+            append(_buffer, &type, 1);
+            append(_buffer, &key, sizeof(Key));
+            append(_buffer, &value, sizeof(Value));
+
+            uint32_t crc = avlCrc32(_buffer.data() + start, _buffer.size() - start);
+            append(_buffer, &crc, sizeof(crc));
+
+            if(++_logged >= _checkpointInterval)
+                checkpoint();
+            else if(++_pending >= _groupSize)
+                commit();
+        }
+
+        /**
+         *	Loads the latest checkpoint, replays its log onto it and deletes the
+         *	files of older checkpoints.
+         */
+        void recover()
+        {
+            std::vector<unsigned long> generations;
+            DIR * dir = ::opendir(_dir.c_str());
+            if(dir == NULL)
+                fail("Could not open " + _dir);
+
+            while(struct dirent * entry = ::readdir(dir))
+            {
+                unsigned long generation;
+                if(sscanf(entry->d_name, "checkpoint-%lu", &generation) == 1)
+                    generations.push_back(generation);
+            }
+            ::closedir(dir);
+
+            std::vector<Entry> entries;
+            std::sort(generations.begin(), generations.end());
+            _latest = generations.empty() ? 0 : generations.back();
+
+            /**
+             *	Fall back to older checkpoints if the newest ones are corrupted, but
+             *	never to an empty tree: their operations would be lost for good.
+             */
+            while(!generations.empty())
+            {
+                _generation = generations.back();
+                generations.pop_back();
+
+                if(readCheckpoint(entries))
+                    break;
+
+                logwarn << "Ignoring corrupted checkpoint " << file("checkpoint-", _generation) << std::endl;
+                if(generations.empty())
+                    throw new std::runtime_error("AvlDurableTree: No readable checkpoint in " + _dir);
+            }
+
+            std::vector<char> log;
+            readFile(file("wal-", _generation), log);
+
+            /**
+             *	Keep the records up to the first torn or corrupted one, which can
+             *	only be the last one written before a crash.
+             */
+            std::vector<Entry> records;
+            std::vector<unsigned char> types;
+            size_t valid = 0;
+
+            for(; valid + RECORD_SIZE <= log.size(); valid += RECORD_SIZE)
+            {
+                const char * record = log.data() + valid;
+                uint32_t crc;
+                memcpy(&crc, record + RECORD_SIZE - sizeof(crc), sizeof(crc));
+
+                if(crc != avlCrc32(record, RECORD_SIZE - sizeof(crc)))
+                    break;
+
+                Entry entry;
+                memcpy(&entry.key, record + 1, sizeof(Key));
+                memcpy(&entry.value, record + 1 + sizeof(Key), sizeof(Value));
+                records.push_back(entry);
+                types.push_back(record[0]);
+            }
+
+            if(valid != log.size())
+                logwarn << "Dropping " << log.size() - valid << " bytes of torn or corrupted log" << std::endl;
+
+            replay(entries, records, types);
+            _tree.assignSorted(entries.begin(), entries.end());
+
+            openLog(0);
+            if(::ftruncate(_walFd, valid) != 0)
+                fail("Could not truncate the write-ahead log");
+            _logged = records.size();
+
+            /**
+             *	Delete whatever a crash in the middle of a checkpoint left behind.
+             */
+            for(size_t i = 0; i < generations.size(); i++)
+            {
+                ::unlink(file("checkpoint-", generations[i]).c_str());
+                ::unlink(file("wal-", generations[i]).c_str());
+            }
+            ::unlink(path("checkpoint.tmp").c_str());
+        }
+
+        /**
+         *	Applies the log records to the sorted checkpoint entries. The records are
+         *	stably sorted by key, so the operations on every key stay in log order,
+         *	and then merged with the entries of that key in a single pass.
+         */
+        void replay(std::vector<Entry>& entries, const std::vector<Entry>& records, const std::vector<unsigned char>& types)
+        {
+            if(records.empty())
+                return;
+
+            std::vector<size_t> order(records.size());
+            for(size_t i = 0; i < order.size(); i++)
+                order[i] = i;
+
+            std::stable_sort(order.begin(), order.end(), RecordLess(records, _compare));
+
+            std::vector<Entry> merged;
+            merged.reserve(entries.size() + records.size());
+
+            size_t i = 0, j = 0;
+            while(i < entries.size() || j < order.size())
+            {
+                Key key = (j == order.size() || (i < entries.size() && !_compare(records[order[j]].key, entries[i].key)))
+                    ? entries[i].key : records[order[j]].key;
+
+                /**
+                 *	Copy the values of the key, then apply its operations: inserts
+                 *	append a value and removes drop the oldest one.
+                 */
+                size_t first = merged.size(), oldest = first;
+                for(; i < entries.size() && !_compare(key, entries[i].key); i++)
+                    merged.push_back(entries[i]);
+
+                for(; j < order.size() && !_compare(key, records[order[j]].key); j++)
+                {
+                    if(types[order[j]] == INSERT)
+                        merged.push_back(records[order[j]]);
+                    else if(oldest < merged.size())
+                        oldest++;
+                }
+
+                merged.erase(merged.begin() + first, merged.begin() + oldest);
+            }
+
+            entries.swap(merged);
+        }
+
+        class RecordLess
+        {
+            public:
+                RecordLess(const std::vector<Entry>& records, const Compare& compare)
+                    :	_records(records), _compare(compare)
+                {}
+
+                bool operator()(size_t a, size_t b) const { return _compare(_records[a].key, _records[b].key); }
+
+            private:
+                const std::vector<Entry>& _records;
+                const Compare& _compare;
+        };
+
+        /**
+         *	Reads the current checkpoint, if any, and returns false if it is corrupted.
+         */
+        bool readCheckpoint(std::vector<Entry>& entries)
+        {
+            std::vector<char> image;
+            if(!readFile(file("checkpoint-", _generation), image))
+                return _generation == 0;
+
+            uint32_t magic, crc;
+            uint64_t count;
+            size_t header = sizeof(magic) + sizeof(count);
+
+            if(image.size() < header + sizeof(crc))
+                return false;
+
+            memcpy(&magic, image.data(), sizeof(magic));
+            memcpy(&count, image.data() + sizeof(magic), sizeof(count));
+            memcpy(&crc, image.data() + image.size() - sizeof(crc), sizeof(crc));
+
+            if(magic != CHECKPOINT_MAGIC || image.size() != header + count * (sizeof(Key) + sizeof(Value)) + sizeof(crc) ||
+                crc != avlCrc32(image.data(), image.size() - sizeof(crc)))
+                return false;
+
+            entries.resize(count);
+            const char * it = image.data() + header;
+            for(uint64_t i = 0; i < count; i++)
+            {
+                memcpy(&entries[i].key, it, sizeof(Key));
+                memcpy(&entries[i].value, it + sizeof(Key), sizeof(Value));
+                it += sizeof(Key) + sizeof(Value);
+            }
+
+            return true;
+        }
+
+        /**
+         *	Opens the log of the current checkpoint for appending, creating it if
+         *	needed. New checkpoints pass O_TRUNC, since their log must start empty.
+         */
+        void openLog(int flags)
+        {
+            if(_walFd != -1)
+                ::close(_walFd);
+
+            std::string wal = file("wal-", _generation);
+            _walFd = ::open(wal.c_str(), O_WRONLY | O_CREAT | O_APPEND | flags, 0644);
+            if(_walFd == -1)
+                fail("Could not open " + wal);
+        }
+
+        /**
+         *	Makes renames and newly created files in the directory durable.
+         */
+        void syncDir()
+        {
+            int fd = ::open(_dir.c_str(), O_RDONLY);
+            if(fd == -1)
+                fail("Could not open " + _dir);
+
+            int rc = ::fsync(fd);
+            ::close(fd);
+
+            if(rc != 0)
+                fail("Could not sync " + _dir);
+        }
+
+        /**
+         *	Reads the whole file and returns false if it does not exist.
+         */
+        bool readFile(const std::string& name, std::vector<char>& contents)
+        {
+            contents.clear();
+
+            int fd = ::open(name.c_str(), O_RDONLY);
+            if(fd == -1)
+            {
+                if(errno == ENOENT)
+                    return false;
+                fail("Could not open " + name);
+            }
+
+            char chunk[1 << 16];
+            ssize_t n;
+            while((n = ::read(fd, chunk, sizeof(chunk))) > 0)
+                contents.insert(contents.end(), chunk, chunk + n);
+
+            ::close(fd);
+
+            if(n < 0)
+                fail("Could not read " + name);
+
+            return true;
+        }
+
+        void writeAll(int fd, const char * data, size_t length, const char * what)
+        {
+            while(length > 0)
+            {
+                ssize_t n = ::write(fd, data, length);
+                if(n < 0)
+                {
+                    if(errno == EINTR)
+                        continue;
+                    fail(std::string("Could not write the ") + what);
+                }
+
+                data += n;
+                length -= n;
+            }
+        }
+
+        static void append(std::vector<char>& buffer, const void * data, size_t length)
+        {
+            const char * bytes = static_cast<const char *>(data);
+            buffer.insert(buffer.end(), bytes, bytes + length);
+        }
+
+        std::string path(const std::string& name) const { return _dir + "/" + name; }
+
+        std::string file(const char * prefix, unsigned long generation) const
+        {
+            char name[64];
+            snprintf(name, sizeof(name), "%s%lu", prefix, generation);
+            return path(name);
+        }
+
+        void fail(const std::string& message) const
+        {
+            throw new std::runtime_error("AvlDurableTree: " + message + ": " + strerror(errno));
+        }
+
+    private:
+        Tree _tree;
+        Compare _compare;
+
+        std::string _dir;
+
+        /**
+         *	The number of operations committed (written and synced) at once.
+         */
+        unsigned int _groupSize;
+
+        /**
+         *	The number of logged operations after which a new checkpoint is taken.
+         */
+        unsigned long _checkpointInterval;
+
+        /**
+         *	The number of the current checkpoint, which is also the number of its log.
+         */
+        unsigned long _generation;
+
+        /**
+         *	The highest checkpoint number in the directory, which may belong to a
+         *	corrupted checkpoint. New checkpoints are numbered above it, so they
+         *	never pick up the stale log of a checkpoint that was skipped.
+         */
+        unsigned long _latest;
+
+        int _walFd;
+
+        /**
+         *	The log records that have not been committed yet, and their number.
+         */
+        std::vector<char> _buffer;
+        unsigned int _pending;
+
+        /**
+         *	The number of records in the current log.
+         */
+        unsigned long _logged;
+};
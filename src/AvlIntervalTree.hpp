@@ -0,0 +1,128 @@
+/**
+ * Author: Alin Tomescu
+ * Website: http://alinush.is-great.org
+ */
+
+#pragma once
+
+#include <Core.hpp>
+
+#include <AvlTree.hpp>
+
+#include <functional>
+#include <ostream>
+
+/**
+ *	A closed interval [lo, hi], ordered by its low endpoint and then by its
+ *	high endpoint.
+ */
+template<class T>
+class AvlInterval
+{
+    public:
+        AvlInterval() {}
+        AvlInterval(const T& l, const T& h)
+            :	lo(l), hi(h)
+        {}
+
+    public:
+        bool operator<(const AvlInterval<T>& other) const
+        {
+            return lo < other.lo || (!(other.lo < lo) && hi < other.hi);
+        }
+
+        bool overlaps(const T& l, const T& h) const { return !(h < lo) && !(hi < l); }
+
+    public:
+        T lo, hi;
+};
+
+template<class T>
+std::ostream& operator<<(std::ostream& out, const AvlInterval<T>& interval)
+{
+    return out << "[" << interval.lo << ", " << interval.hi << "]";
+}
+
+/**
+ *	Keeps the largest high endpoint of the intervals in every subtree, which
+ *	lets overlap queries skip the subtrees that end before the query starts.
+ */
+template<class T>
+class AvlIntervalAugment
+{
+    public:
+        enum { enabled = 1 };
+
+        template<class Node>
+        static void update(Node * node)
+        {
+            node->maxHi = node->entry.key.hi;
+
+            for(unsigned int i = 0; i < 2; i++)
+                if(node->getChild(i) && node->maxHi < node->getChild(i)->maxHi)
+                    node->maxHi = node->getChild(i)->maxHi;
+        }
+
+    public:
+        T maxHi;
+};
+
+/**
+ *	An interval map: an AvlTree keyed by intervals that answers "which intervals
+ *	overlap [lo, hi]" and "which intervals contain a point" in O(min(n, k log n))
+ *	time, where k is the number of intervals reported: the maximum high endpoints
+ *	prune the subtrees without results, but every result may still cost a walk
+ *	down to a leaf when the results are sparse.
+ */
+template<class T, class Value>
+class AvlIntervalTree : public AvlTree<AvlInterval<T>, Value, std::less<AvlInterval<T> >, AvlIntervalAugment<T> >
+{
+    protected:
+        typedef AvlTree<AvlInterval<T>, Value, std::less<AvlInterval<T> >, AvlIntervalAugment<T> > Base;
+
+    public:
+        typedef typename Base::Node Node;
+
+    public:
+        /**
+         *	Calls visit(Node *) for every interval that overlaps [lo, hi], in order.
+         */
+        template<class Visitor>
+        void overlapping(const T& lo, const T& hi, Visitor visit)
+        {
+            avlOverlapping(Base::_root, lo, hi, visit);
+        }
+
+        /**
+         *	Calls visit(Node *) for every interval that contains the point, in order.
+         */
+        template<class Visitor>
+        void stab(const T& point, Visitor visit)
+        {
+            avlOverlapping(Base::_root, point, point, visit);
+        }
+
+    protected:
+        template<class Visitor>
+        void avlOverlapping(Node * node, const T& lo, const T& hi, Visitor& visit)
+        {
+            /**
+             *	Nothing in a subtree whose intervals all end before lo can overlap.
+             */
+            while(node && !(node->maxHi < lo))
+            {
+                avlOverlapping(node->getLeft(), lo, hi, visit);
+
+                /**
+                 *	This interval and all the ones to its right start after hi.
+                 */
+                if(hi < node->entry.key.lo)
+                    return;
+
+                if(!(node->entry.key.hi < lo))
+                    visit(node);
+
+                node = node->getRight();
+            }
+        }
+};
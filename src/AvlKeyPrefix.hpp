@@ -0,0 +1,125 @@
+/**
+ * Author: Alin Tomescu
+ * Website: http://alinush.is-great.org
+ */
+
+#pragma once
+
+#include <Core.hpp>
+
+#include <AvlTree.hpp>
+
+#include <cstdint>
+#include <functional>
+#include <ostream>
+#include <string>
+#include <utility>
+
+/**
+ *	Normalizes a string into its first 8 bytes, in big-endian order and padded
+ *	with zeros, so comparing two prefixes as integers orders them the same way
+ *	as comparing the strings they come from, except for ties.
+ */
+class AvlStringPrefix
+{
+    public:
+        uint64_t operator()(const std::string& key) const
+        {
+            uint64_t prefix = 0;
+            size_t length = key.size() < 8 ? key.size() : 8;
+
+            for(size_t i = 0; i < length; i++)
+                prefix |= static_cast<uint64_t>(static_cast<unsigned char>(key[i])) << (56 - 8 * i);
+
+            return prefix;
+        }
+};
+
+/**
+ *	A key stored next to a fixed-width prefix of itself. Since the prefix lives
+ *	inline in the node, most comparisons in find() and insert() only look at
+ *	the prefixes, and the full Compare, which may have to chase the key into
+ *	the heap, only runs when they tie.
+ *
+ *	The Prefix must preserve the order: if a < b, then Prefix()(a) <= Prefix()(b).
+ *	Keys that usually share their first bytes (e.g., URLs that all start with
+ *	"https://www.") tie on the prefix every time and gain nothing.
+ *
+ *	Keys convert implicitly, so an AvlTree<AvlPrefixedKey<std::string>, Value>
+ *	can be searched and updated with plain strings. The conversion copies the
+ *	string, though, so hot lookups should go through avlFindPrefixed() instead.
+ */
+template<class Key, class Prefix = AvlStringPrefix, class Compare = std::less<Key> >
+class AvlPrefixedKey
+{
+    public:
+        typedef Key Unprefixed;
+
+    public:
+        AvlPrefixedKey() : prefix(0) {}
+        AvlPrefixedKey(const Key& k) : prefix(Prefix()(k)), key(k) {}
+        AvlPrefixedKey(Key&& k) : prefix(Prefix()(k)), key(std::move(k)) {}
+
+        /**
+         *	Strings are usually spelled as literals.
+         */
+        AvlPrefixedKey(const char * k) : prefix(0), key(k) { prefix = Prefix()(key); }
+
+    public:
+        bool operator<(const AvlPrefixedKey& other) const
+        {
+            if(prefix != other.prefix)
+                return prefix < other.prefix;
+
+            return Compare()(key, other.key);
+        }
+
+        bool operator==(const AvlPrefixedKey& other) const
+        {
+            return prefix == other.prefix && !Compare()(key, other.key) && !Compare()(other.key, key);
+        }
+
+        bool operator!=(const AvlPrefixedKey& other) const { return !(*this == other); }
+
+        /**
+         *	Compare with a key that was not copied into an AvlPrefixedKey, given its prefix.
+         */
+        bool lessThan(uint64_t p, const Key& k) const { return prefix != p ? prefix < p : Compare()(key, k); }
+        bool greaterThan(uint64_t p, const Key& k) const { return prefix != p ? p < prefix : Compare()(k, key); }
+
+    public:
+        uint64_t prefix;
+        Key key;
+};
+
+/**
+ *	Looks the key up like AvlTree::find() does, but compares the nodes against
+ *	the key and its prefix as they are, rather than against an AvlPrefixedKey
+ *	built from a copy of the key. The tree must be ordered by AvlPrefixedKey's
+ *	operator<, and its hot cache, if any, is bypassed.
+ */
+template<class Key, class Prefix, class Compare, class Value, class TreeCompare, class Augment>
+Value * avlFindPrefixed(AvlTree<AvlPrefixedKey<Key, Prefix, Compare>, Value, TreeCompare, Augment>& tree,
+    const typename AvlPrefixedKey<Key, Prefix, Compare>::Unprefixed& key)
+{
+    uint64_t prefix = Prefix()(key);
+    AvlNode<AvlPrefixedKey<Key, Prefix, Compare>, Value, Augment> * it = tree.getRoot();
+
+    while(it)
+    {
+        if(it->entry.key.greaterThan(prefix, key))
+            it = it->child[0];
+        else if(it->entry.key.lessThan(prefix, key))
+            it = it->child[1];
+        else
+            return &it->entry.value;
+    }
+
+    return NULL;
+}
+
+template<class Key, class Prefix, class Compare>
+std::ostream& operator<<(std::ostream& out, const AvlPrefixedKey<Key, Prefix, Compare>& key)
+{
+    return out << key.key;
+}
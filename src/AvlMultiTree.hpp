@@ -0,0 +1,316 @@
+/**
+ * Author: Alin Tomescu
+ * Website: http://alinush.is-great.org
+ */
+
+#pragma once
+
+#include <Core.hpp>
+
+#include <AvlTree.hpp>
+
+#include <algorithm>
+#include <functional>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+/**
+ *	The values of a key, oldest first. Removing the oldest value only moves
+ *	head forward, and the dead values are dropped once they make up half of
+ *	the vector, so draining a key costs amortized O(1) per value while the
+ *	live values stay contiguous.
+ */
+template<class Value>
+class AvlMultiValues
+{
+    public:
+        AvlMultiValues() : head(0) {}
+        explicit AvlMultiValues(const Value& value) : values(1, value), head(0) {}
+
+    public:
+        size_t size() const { return values.size() - head; }
+
+        Value * begin() { return values.data() + head; }
+        Value * end() { return values.data() + values.size(); }
+        const Value * begin() const { return values.data() + head; }
+        const Value * end() const { return values.data() + values.size(); }
+
+        Value& front() { return values[head]; }
+        Value& back() { return values.back(); }
+
+        void push_back(const Value& value) { values.push_back(value); }
+        void pop_back() { values.pop_back(); }
+
+        /**
+         *	Drops the n oldest values.
+         */
+        void popFront(size_t n = 1)
+        {
+            head += n;
+
+            if(head * 2 >= values.size())
+            {
+                values.erase(values.begin(), values.begin() + head);
+                head = 0;
+            }
+        }
+
+        /**
+         *	Moves the live values out.
+         */
+        std::vector<Value> take()
+        {
+            values.erase(values.begin(), values.begin() + head);
+            head = 0;
+            return std::move(values);
+        }
+
+    public:
+        std::vector<Value> values;
+        size_t head;
+};
+
+/**
+ *	A multimap that keeps all the values of a key in a single node, in
+ *	insertion order, instead of adding one node per duplicate like AvlTree
+ *	does. With heavily repeated keys this keeps the tree as small and as
+ *	short as the number of distinct keys allows.
+ */
+template<class Key, class Value, class Compare = std::less<Key>, class Augment = AvlNoAugment>
+class AvlMultiTree : public AvlTree<Key, AvlMultiValues<Value>, Compare, Augment>
+{
+    protected:
+        typedef AvlTree<Key, AvlMultiValues<Value>, Compare, Augment> Base;
+
+    public:
+        typedef AvlEntry<Key, Value> Entry;
+        
+    public:
+        AvlMultiTree() : _count(0) {}
+        explicit AvlMultiTree(const Compare& compare) : Base(compare), _count(0) {}
+
+    public:
+        /**
+         *	Appends the value to the values of the specified key. A new node is
+         *	only created (and the tree only rebalanced) for a new key.
+         */
+        void insert(const Key& key, const Value& value)
+        {
+            AvlMultiValues<Value> * values = Base::find(key);
+
+            if(values == NULL)
+                Base::insert(key, AvlMultiValues<Value>(value));
+            else
+                values->push_back(value);
+
+            _count++;
+        }
+
+        /**
+         *	Removes the oldest value of the specified key and returns it, like
+         *	AvlTree::remove(). The node is removed along with the last value.
+         */
+        Value remove(const Key& key)
+        {
+            AvlMultiValues<Value> * values = Base::find(key);
+            
+            if(values == NULL)
+                throw new std::runtime_error("AvlMultiTree::remove(const Key&) could not find specified key.");
+            
+            Value value = std::move(values->front());
+            
+            if(values->size() == 1)
+                Base::remove(key);
+            else
+                values->popFront();
+            
+            _count--;
+            return value;
+        }
+        
+        /**
+         *	Removes all the values of the specified key and returns them.
+         */
+        std::vector<Value> removeAll(const Key& key)
+        {
+            std::vector<Value> values = Base::remove(key).take();
+            _count -= values.size();
+            return values;
+        }
+
+        /**
+         *	Removes all the values with keys in [lo, hi] and returns their number.
+         */
+        unsigned long eraseRange(const Key& lo, const Key& hi)
+        {
+            Base range = Base::extractRange(lo, hi);
+            return countValues(range);
+        }
+
+        /**
+         *	Moves all the values with keys in [lo, hi] into a new tree.
+         */
+        AvlMultiTree extractRange(const Key& lo, const Key& hi)
+        {
+            AvlMultiTree range(Base::extractRange(lo, hi));
+            range._count = countValues(range);
+            return range;
+        }
+
+        /**
+         *	Removes the oldest value of the smallest key and returns it, with its key.
+         */
+        Entry popMin()
+        {
+            typename Base::Node * node = Base::min();
+            
+            if(node == NULL)
+                throw new std::runtime_error("AvlMultiTree::popMin() called on an empty tree.");
+            
+            AvlMultiValues<Value>& values = node->getValueRef();
+            Entry entry(node->entry.key, std::move(values.front()));
+            
+            if(values.size() == 1)
+                Base::popMin();
+            else
+                values.popFront();
+            
+            _count--;
+            return entry;
+        }
+        
+        /**
+         *	Removes the newest value of the largest key and returns it, with its key.
+         */
+        Entry popMax()
+        {
+            typename Base::Node * node = Base::max();
+            
+            if(node == NULL)
+                throw new std::runtime_error("AvlMultiTree::popMax() called on an empty tree.");
+            
+            AvlMultiValues<Value>& values = node->getValueRef();
+            Entry entry(node->entry.key, std::move(values.back()));
+            
+            if(values.size() == 1)
+                Base::popMax();
+            else
+                values.pop_back();
+            
+            _count--;
+            return entry;
+        }
+        
+        /**
+         *	Removes the (at most) k smallest values, in order, and appends them to
+         *	out along with their keys. Returns the number of values removed. Keys
+         *	whose values are all taken are split off the tree in a single batch.
+         */
+        unsigned long popMinN(unsigned long k, std::vector<Entry>& out)
+        {
+            unsigned long popped = 0, nodes = 0;
+            
+            for(typename Base::Node * it = Base::min(); it && popped < k; it = it->getNext())
+            {
+                AvlMultiValues<Value>& values = it->getValueRef();
+                unsigned long taken = std::min<unsigned long>(k - popped, values.size());
+                
+                for(unsigned long i = 0; i < taken; i++)
+                    out.push_back(Entry(it->entry.key, std::move(values.begin()[i])));
+                
+                popped += taken;
+                if(taken == values.size())
+                    nodes++;
+                else
+                    values.popFront(taken);
+            }
+            
+            std::vector<typename Base::Entry> emptied;
+            Base::popMinN(nodes, emptied);
+            
+            _count -= popped;
+            return popped;
+        }
+        
+        /**
+         *	Replaces the contents of the tree with the (key, value) entries in the
+         *	sorted random-access range, keeping the values of equal keys in order.
+         */
+        template<class It>
+        void assignSorted(It first, It last)
+        {
+            std::vector<typename Base::Entry> grouped;
+            
+            for(It it = first; it != last; ++it)
+            {
+                if(grouped.empty() || Base::_compare(grouped.back().key, it->key))
+                    grouped.push_back(typename Base::Entry(it->key, AvlMultiValues<Value>()));
+                
+                grouped.back().value.push_back(it->value);
+            }
+            
+            Base::assignSorted(grouped.begin(), grouped.end());
+            _count = last - first;
+        }
+        
+        /**
+         *	Returns the number of values stored under the specified key.
+         */
+        unsigned long count(const Key& key) const
+        {
+            const AvlMultiValues<Value> * values = Base::find(key);
+            return values ? values->size() : 0;
+        }
+
+        /**
+         *	Returns the [first, last) range of values stored under the specified
+         *	key, in insertion order, or an empty range if there are none.
+         */
+        std::pair<Value *, Value *> equalRange(const Key& key)
+        {
+            AvlMultiValues<Value> * values = Base::find(key);
+
+            if(values == NULL)
+                return std::pair<Value *, Value *>(NULL, NULL);
+
+            return std::make_pair(values->begin(), values->end());
+        }
+
+        /**
+         *	Returns the number of (key, value) pairs stored into the tree.
+         */
+        unsigned long size() const { return _count; }
+
+        /**
+         *	Returns the number of nodes, which is the number of distinct keys.
+         */
+        unsigned long nodes() const { return Base::size(); }
+
+    protected:
+        explicit AvlMultiTree(Base&& range) : Base(std::move(range)), _count(0) {}
+
+        /**
+         *	Subtracts the values in a range extracted from this tree from the count.
+         */
+        unsigned long countValues(Base& range)
+        {
+            unsigned long values = 0;
+            typename Base::Node * it = range.getRoot();
+
+            while(it && it->getLeft())
+                it = it->getLeft();
+
+            for(; it; it = it->getNext())
+                values += it->getValueRef().size();
+
+            _count -= values;
+            return values;
+        }
+
+        /**
+         *	The number of (key, value) pairs, as opposed to Base::_size which
+         *	counts nodes.
+         */
+        unsigned long _count;
+};
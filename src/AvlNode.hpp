@@ -23,11 +23,52 @@ class AvlEntry
         Value value;
 };
 
-template<class Key, class Value>
-class AvlNode
+/**
+ *	An augmentation adds data to every node that is computed from the node
+ *	itself and its children (e.g. subtree size). The tree calls update() on
+ *	every node whose subtree changed, children before parents, whenever
+ *	enabled is non-zero. The augmentation is a base class of AvlNode, so the
+ *	empty one costs nothing.
+ */
+class AvlNoAugment
+{
+    public:
+        enum { enabled = 0 };
+
+        template<class Node>
+        static void update(Node *) {}
+};
+
+/**
+ *	Keeps the number of nodes in every subtree, which makes rank queries
+ *	and AvlTree::count(key) logarithmic.
+ */
+class AvlSizeAugment
+{
+    public:
+        AvlSizeAugment() : subtreeSize(1) {}
+
+    public:
+        enum { enabled = 1 };
+
+        template<class Node>
+        static void update(Node * node)
+        {
+            node->subtreeSize = 1 + size(node->getLeft()) + size(node->getRight());
+        }
+
+        template<class Node>
+        static unsigned long size(const Node * node) { return node ? node->subtreeSize : 0; }
+
+    public:
+        unsigned long subtreeSize;
+};
+
+template<class Key, class Value, class Augment = AvlNoAugment>
+class AvlNode : public Augment
 {
     private:
-        typedef AvlNode<Key, Value> Node;
+        typedef AvlNode<Key, Value, Augment> Node;
         typedef AvlEntry<Key, Value> Entry;
 
         enum { LEFT = 0, RIGHT = 1 };
@@ -70,6 +111,33 @@ class AvlNode
         Node * getChild(unsigned int index) { return child[index]; }
         const Node * getChild(unsigned int index) const { return child[index]; }
     
+        /**
+         *	Returns the in-order successor (or predecessor) of this node, or null
+         *	if this is the last (or first) node in the tree.
+         */
+        Node * getNext() { return getNeighbour(RIGHT); }
+        Node * getPrev() { return getNeighbour(LEFT); }
+        const Node * getNext() const { return const_cast<Node *>(this)->getNeighbour(RIGHT); }
+        const Node * getPrev() const { return const_cast<Node *>(this)->getNeighbour(LEFT); }
+        Node * getNeighbour(unsigned int dir)
+        {
+            unsigned int opposed = dir ? LEFT : RIGHT;
+            Node * it = this;
+
+            if(it->child[dir])
+            {
+                it = it->child[dir];
+                while(it->child[opposed])
+                    it = it->child[opposed];
+                return it;
+            }
+
+            while(it->parent && it->parent->child[dir] == it)
+                it = it->parent;
+
+            return it->parent;
+        }
+
         bool isLeftChild(const Node * node) const { return getChildIndex(node) == LEFT; }
         bool isRightChild(const Node * node) const { return getChildIndex(node) == RIGHT; }
         unsigned int getChildIndex(const Node * node) const
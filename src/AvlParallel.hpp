@@ -0,0 +1,453 @@
+/**
+ * Author: Alin Tomescu
+ * Website: http://alinush.is-great.org
+ */
+
+#pragma once
+
+#include <Core.hpp>
+
+#include <AvlNode.hpp>
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/**
+ *	A pool of threads that run tasks which may spawn more tasks. Every worker
+ *	has its own deque: it pushes and pops the tasks it spawns at the back, so
+ *	it goes depth-first, and idle workers steal from the front of the others'
+ *	deques, where the oldest and therefore largest tasks are.
+ *
+ *	Tasks receive the index of the worker running them, which they pass back
+ *	to spawn() and may use to index per-worker data.
+ *
+ *	A worker that finds no task yields for a while, since tasks usually spawn
+ *	more soon, and then sleeps until a task is spawned or the run is over.
+ */
+class AvlThreadPool
+{
+    public:
+        typedef std::function<void(unsigned int)> Task;
+
+    public:
+        explicit AvlThreadPool(unsigned int threads = std::thread::hardware_concurrency())
+            :	_queues(new AvlWorkQueue[threads ? threads : 1]), _size(threads ? threads : 1),
+                _outstanding(0), _queued(0), _sleeping(0), _generation(0), _stop(false)
+        {
+            for(unsigned int i = 0; i < _size; i++)
+                _threads.push_back(std::thread(&AvlThreadPool::work, this, i));
+        }
+
+        AvlThreadPool(const AvlThreadPool&) = delete;
+        AvlThreadPool& operator=(const AvlThreadPool&) = delete;
+
+        ~AvlThreadPool()
+        {
+            {
+                std::lock_guard<std::mutex> lock(_mutex);
+                _stop = true;
+            }
+            _wake.notify_all();
+
+            for(size_t i = 0; i < _threads.size(); i++)
+                _threads[i].join();
+        }
+
+    public:
+        /**
+         *	Runs the task and all the tasks it spawns, and returns once they are
+         *	all done. If any of them throws, the first exception is rethrown here.
+         */
+        void run(Task task)
+        {
+            std::unique_lock<std::mutex> lock(_mutex);
+            _error = std::exception_ptr();
+            spawn(0, std::move(task));
+            _generation++;
+            _wake.notify_all();
+
+            _done.wait(lock, [this]() { return _outstanding == 0; });
+
+            if(_error)
+                std::rethrow_exception(_error);
+        }
+
+        /**
+         *	Queues a task on the specified worker's deque. Only call this from
+         *	within a task, with the worker the task runs on.
+         */
+        void spawn(unsigned int worker, Task task)
+        {
+            _outstanding++;
+
+            {
+                std::lock_guard<std::mutex> lock(_queues[worker].mutex);
+                _queues[worker].tasks.push_back(std::move(task));
+                _queued++;
+            }
+
+            if(_sleeping > 0)
+            {
+                std::lock_guard<std::mutex> lock(_mutex);
+                _idle.notify_one();
+            }
+        }
+
+        unsigned int size() const { return _size; }
+
+    private:
+        void work(unsigned int worker)
+        {
+            unsigned long generation = 0;
+            unsigned int misses = 0;
+
+            while(true)
+            {
+                {
+                    std::unique_lock<std::mutex> lock(_mutex);
+                    _wake.wait(lock, [&]() { return _stop || _generation != generation; });
+                    if(_stop)
+                        return;
+                    generation = _generation;
+                }
+
+                while(_outstanding > 0)
+                {
+                    Task task;
+                    if(!take(worker, task))
+                    {
+                        if(++misses < IDLE_SPINS)
+                        {
+                            std::this_thread::yield();
+                            continue;
+                        }
+
+                        /**
+                         *	spawn() only notifies when it sees a sleeper, so count
+                         *	ourselves in before checking for tasks one last time.
+                         */
+                        std::unique_lock<std::mutex> lock(_mutex);
+                        _sleeping++;
+                        _idle.wait(lock, [this]() { return _outstanding == 0 || _queued > 0; });
+                        _sleeping--;
+                        misses = 0;
+                        continue;
+                    }
+
+                    misses = 0;
+
+                    try
+                    {
+                        task(worker);
+                    }
+                    catch(...)
+                    {
+                        std::lock_guard<std::mutex> lock(_mutex);
+                        if(!_error)
+                            _error = std::current_exception();
+                    }
+
+                    if(--_outstanding == 0)
+                    {
+                        std::lock_guard<std::mutex> lock(_mutex);
+                        _done.notify_all();
+                        _idle.notify_all();
+                    }
+                }
+            }
+        }
+
+        /**
+         *	Pops the newest task of the worker, or steals the oldest task of another.
+         */
+        bool take(unsigned int worker, Task& task)
+        {
+            for(unsigned int i = 0; i < _size; i++)
+            {
+                AvlWorkQueue& queue = _queues[(worker + i) % _size];
+                std::lock_guard<std::mutex> lock(queue.mutex);
+
+                if(queue.tasks.empty())
+                    continue;
+
+                if(i == 0)
+                {
+                    task = std::move(queue.tasks.back());
+                    queue.tasks.pop_back();
+                }
+                else
+                {
+                    task = std::move(queue.tasks.front());
+                    queue.tasks.pop_front();
+                }
+
+                _queued--;
+                return true;
+            }
+
+            return false;
+        }
+
+    private:
+        /**
+         *	How many times an idle worker looks for a task before going to sleep.
+         */
+        enum { IDLE_SPINS = 64 };
+
+        struct AvlWorkQueue
+        {
+            std::mutex mutex;
+            std::deque<Task> tasks;
+        };
+
+        std::unique_ptr<AvlWorkQueue[]> _queues;
+        unsigned int _size;
+        std::vector<std::thread> _threads;
+
+        /**
+         *	The number of tasks spawned but not yet finished.
+         */
+        std::atomic<unsigned long> _outstanding;
+
+        /**
+         *	The number of tasks waiting in the deques, and of workers asleep until
+         *	one is spawned.
+         */
+        std::atomic<unsigned long> _queued;
+        std::atomic<unsigned int> _sleeping;
+
+        /**
+         *	Protects the fields below, wakes up the workers for every run() and
+         *	wakes up the idle ones when there are tasks to take again.
+         */
+        std::mutex _mutex;
+        std::condition_variable _wake, _done, _idle;
+        unsigned long _generation;
+        bool _stop;
+        std::exception_ptr _error;
+};
+
+/**
+ *	Subtrees of at most this height (a few thousand nodes) are walked by a
+ *	single task, so the cost of a task is small next to the work it does.
+ */
+const int AVL_PARALLEL_GRAIN = 12;
+
+template<class Node>
+int avlParallelHeight(const Node * root)
+{
+    int height = 0;
+
+    for(; root; height++)
+        root = root->child[root->balance < 0 ? 0 : 1];
+
+    return height;
+}
+
+/**
+ *	Calls visit(node) for every node of the subtree, in order.
+ */
+template<class Node, class Visitor>
+void avlParallelWalk(Node * root, Visitor& visit)
+{
+    Node * last = root;
+    while(last->child[1])
+        last = last->child[1];
+
+    Node * end = last->getNext();
+    while(root->child[0])
+        root = root->child[0];
+
+    for(; root != end; root = root->getNext())
+        visit(root);
+}
+
+/**
+ *	Splits the subtree into the nodes above the grain height, which it passes
+ *	to visitNode(worker, node), and the subtrees below it, which it passes to
+ *	visitSubtree(worker, root). The right subtrees are spawned as new tasks and
+ *	the left ones are split further by the task itself.
+ */
+template<class Node, class NodeVisitor, class SubtreeVisitor>
+void avlParallelSplit(AvlThreadPool& pool, unsigned int worker, Node * node, int height,
+    NodeVisitor& visitNode, SubtreeVisitor& visitSubtree)
+{
+    for(; node && height > AVL_PARALLEL_GRAIN; node = node->child[0])
+    {
+        Node * right = node->child[1];
+        int rightHeight = height - (node->balance < 0 ? 2 : 1);
+
+        if(right)
+            pool.spawn(worker, [&pool, right, rightHeight, &visitNode, &visitSubtree](unsigned int w) {
+                avlParallelSplit(pool, w, right, rightHeight, visitNode, visitSubtree);
+            });
+
+        visitNode(worker, node);
+        height -= node->balance > 0 ? 2 : 1;
+    }
+
+    if(node)
+        visitSubtree(worker, node);
+}
+
+/**
+ *	Calls visit(node) for every node of the tree, from all the threads of the
+ *	pool at once and in no particular order.
+ */
+template<class T, class Visitor>
+void avlParallelForEach(AvlThreadPool& pool, T& tree, Visitor visit)
+{
+    typedef typename T::Node Node;
+
+    auto visitNode = [&visit](unsigned int, Node * node) { visit(node); };
+    auto visitSubtree = [&visit](unsigned int, Node * root) { avlParallelWalk(root, visit); };
+
+    Node * root = tree.getRoot();
+    int height = avlParallelHeight(root);
+
+    pool.run([&](unsigned int worker) {
+        avlParallelSplit(pool, worker, root, height, visitNode, visitSubtree);
+    });
+}
+
+/**
+ *	Returns combine(...combine(identity, map(node))...) over all the nodes of
+ *	the tree. The nodes are combined in no particular order, so combine must be
+ *	associative and commutative.
+ */
+template<class T, class Result, class Map, class Combine>
+Result avlParallelReduce(AvlThreadPool& pool, T& tree, Result identity, Map map, Combine combine)
+{
+    typedef typename T::Node Node;
+
+    /**
+     *	Every subtree is reduced into a local result first, so the workers only
+     *	touch their slots once per task. The slots are padded a cache line apart,
+     *	so workers do not invalidate each other's, and wrapped in a struct, so a
+     *	bool Result does not end up as a bit of a shared word in a vector<bool>.
+     */
+    struct Slot
+    {
+        Result result;
+        char padding[64];
+    };
+
+    Slot slot = { identity, {} };
+    std::vector<Slot> results(pool.size(), slot);
+
+    auto visitNode = [&](unsigned int worker, Node * node) {
+        results[worker].result = combine(results[worker].result, map(node));
+    };
+    auto visitSubtree = [&](unsigned int worker, Node * root) {
+        Result result = identity;
+        auto fold = [&](Node * node) { result = combine(result, map(node)); };
+        avlParallelWalk(root, fold);
+        results[worker].result = combine(results[worker].result, result);
+    };
+
+    Node * root = tree.getRoot();
+    int height = avlParallelHeight(root);
+
+    pool.run([&](unsigned int worker) {
+        avlParallelSplit(pool, worker, root, height, visitNode, visitSubtree);
+    });
+
+    Result result = identity;
+    for(size_t i = 0; i < results.size(); i++)
+        result = combine(result, results[i].result);
+
+    return result;
+}
+
+/**
+ *	The size of a subtree is read from the size augmentation when there is one,
+ *	and counted otherwise. The node is passed a second time to pick the overload,
+ *	since converting it to its AvlSizeAugment base beats converting it to void.
+ */
+template<class Node>
+unsigned long avlParallelCount(const Node *, const AvlSizeAugment * root)
+{
+    return AvlSizeAugment::size(root);
+}
+
+template<class Node>
+unsigned long avlParallelCount(const Node * root, const void *)
+{
+    unsigned long count = 0;
+    auto increment = [&count](const Node *) { count++; };
+    avlParallelWalk(root, increment);
+    return count;
+}
+
+/**
+ *	Writes out[i] = transform(node) for the i-th node of the tree in order, for
+ *	all i in [0, size()), from all the threads of the pool at once. The output
+ *	must already have room for size() elements.
+ *
+ *	The nodes above the grain height and the subtrees below it are listed in
+ *	order first. The sizes of the subtrees are then counted in parallel, unless
+ *	the tree keeps them in a size augmentation, and their prefix sums give every
+ *	task the offset it writes at.
+ */
+template<class T, class RandomIt, class Transform>
+void avlParallelExport(AvlThreadPool& pool, T& tree, RandomIt out, Transform transform)
+{
+    typedef typename T::Node Node;
+
+    struct Piece
+    {
+        Node * root;
+        bool whole;
+        unsigned long size, offset;
+    };
+
+    std::vector<Piece> pieces;
+    std::function<void(Node *, int)> list = [&](Node * node, int height) {
+        if(node == NULL)
+            return;
+
+        if(height <= AVL_PARALLEL_GRAIN)
+        {
+            Piece piece = { node, true, 0, 0 };
+            pieces.push_back(piece);
+            return;
+        }
+
+        list(node->child[0], height - (node->balance > 0 ? 2 : 1));
+        Piece piece = { node, false, 1, 0 };
+        pieces.push_back(piece);
+        list(node->child[1], height - (node->balance < 0 ? 2 : 1));
+    };
+    list(tree.getRoot(), avlParallelHeight(tree.getRoot()));
+
+    pool.run([&](unsigned int worker) {
+        for(size_t i = 0; i < pieces.size(); i++)
+            if(pieces[i].whole)
+                pool.spawn(worker, [&pieces, i](unsigned int) {
+                    pieces[i].size = avlParallelCount(pieces[i].root, pieces[i].root);
+                });
+    });
+
+    for(size_t i = 1; i < pieces.size(); i++)
+        pieces[i].offset = pieces[i - 1].offset + pieces[i - 1].size;
+
+    pool.run([&](unsigned int worker) {
+        for(size_t i = 0; i < pieces.size(); i++)
+            pool.spawn(worker, [&pieces, &out, &transform, i](unsigned int) {
+                RandomIt it = out + pieces[i].offset;
+                auto write = [&](Node * node) { *it++ = transform(node); };
+
+                if(pieces[i].whole)
+                    avlParallelWalk(pieces[i].root, write);
+                else
+                    write(pieces[i].root);
+            });
+    });
+}
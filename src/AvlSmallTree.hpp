@@ -0,0 +1,377 @@
+/**
+ * Author: Alin Tomescu
+ * Website: http://alinush.is-great.org
+ */
+
+#pragma once
+
+#include <Core.hpp>
+
+#include <AvlTree.hpp>
+
+#include <functional>
+#include <new>
+#include <stdexcept>
+#include <type_traits>
+#include <utility>
+
+/**
+ *	An AvlTree for maps that are usually tiny. The first N (key, value) pairs
+ *	are kept sorted in an array inside the object itself and searched linearly,
+ *	so a small map costs no allocations and no pointer chasing. Once it grows
+ *	past N pairs, the map moves into a node-based AvlTree, and it moves back
+ *	into the array once it shrinks to N / 2 pairs (the gap avoids moving back
+ *	and forth on every insert and remove around N).
+ *
+ *	The operations behave like the AvlTree ones, except insert() does not return
+ *	a node, since inline pairs do not have one. For the same reason, the pairs
+ *	are visited in order with forEach() rather than by walking nodes.
+ */
+template<class Key, class Value, unsigned int N = 8, class Compare = std::less<Key>, class Augment = AvlNoAugment>
+class AvlSmallTree
+{
+    public:
+        typedef AvlTree<Key, Value, Compare, Augment> Tree;
+        typedef AvlEntry<Key, Value> Entry;
+
+    public:
+        AvlSmallTree() : _tree(NULL), _count(0) {}
+
+        AvlSmallTree(AvlSmallTree&& other)
+            :	_tree(NULL), _count(0)
+        {
+            take(other);
+        }
+
+        AvlSmallTree(const AvlSmallTree&) = delete;
+        AvlSmallTree& operator=(const AvlSmallTree&) = delete;
+
+        AvlSmallTree& operator=(AvlSmallTree&& other)
+        {
+            if(this != &other)
+            {
+                clearInline();
+                delete _tree;
+                take(other);
+            }
+            return *this;
+        }
+
+        ~AvlSmallTree()
+        {
+            clearInline();
+            delete _tree;
+        }
+
+    public:
+        Value * find(const Key& key)
+        {
+            return const_cast<Value *>(static_cast<const AvlSmallTree *>(this)->find(key));
+        }
+
+        const Value * find(const Key& key) const
+        {
+            if(_tree)
+                return static_cast<const Tree *>(_tree)->find(key);
+
+            const Entry * e = entries();
+            for(unsigned int i = 0; i < _count; i++)
+            {
+                if(_compare(key, e[i].key))
+                    return NULL;
+                if(!_compare(e[i].key, key))
+                    return &e[i].value;
+            }
+
+            return NULL;
+        }
+
+        /**
+         *	Inserts the specified (key, value) pair after the pairs with equal keys.
+         */
+        void insert(const Key& key, const Value& value)
+        {
+            if(_tree == NULL && _count == N)
+                promote();
+
+            if(_tree)
+            {
+                _tree->insert(key, value);
+                return;
+            }
+
+            Entry * e = entries();
+            unsigned int pos = _count;
+            while(pos > 0 && _compare(key, e[pos - 1].key))
+                pos--;
+
+            if(pos == _count)
+                new(e + _count) Entry(key, value);
+            else
+            {
+                new(e + _count) Entry(std::move(e[_count - 1]));
+                for(unsigned int i = _count - 1; i > pos; i--)
+                    e[i] = std::move(e[i - 1]);
+                e[pos] = Entry(key, value);
+            }
+
+            _count++;
+        }
+
+        /**
+         *	Removes the oldest (key, value) pair with the specified key and returns
+         *	its value.
+         */
+        Value remove(const Key& key)
+        {
+            if(_tree)
+            {
+                Value value = _tree->remove(key);
+                demoteIfSmall();
+                return value;
+            }
+
+            Entry * e = entries();
+            unsigned int pos = 0;
+            while(pos < _count && _compare(e[pos].key, key))
+                pos++;
+
+            if(pos == _count || _compare(key, e[pos].key))
+                throw new std::runtime_error("AvlSmallTree::remove(const Key&) could not find specified key.");
+
+            Value value = std::move(e[pos].value);
+            removeInline(pos, pos + 1);
+            return value;
+        }
+
+        /**
+         *	Removes all the (key, value) pairs with keys in [lo, hi] and returns their number.
+         */
+        unsigned long eraseRange(const Key& lo, const Key& hi)
+        {
+            if(_tree)
+            {
+                unsigned long erased = _tree->eraseRange(lo, hi);
+                demoteIfSmall();
+                return erased;
+            }
+
+            Entry * e = entries();
+            unsigned int first = 0, last;
+            while(first < _count && _compare(e[first].key, lo))
+                first++;
+            for(last = first; last < _count && !_compare(hi, e[last].key); last++)
+                ;
+
+            removeInline(first, last);
+            return last - first;
+        }
+
+        /**
+         *	Moves all the (key, value) pairs with keys in [lo, hi] into a new tree.
+         */
+        AvlSmallTree extractRange(const Key& lo, const Key& hi)
+        {
+            AvlSmallTree range;
+
+            if(_tree)
+            {
+                range._tree = new Tree(_tree->extractRange(lo, hi));
+                range.demoteIfSmall();
+                demoteIfSmall();
+                return range;
+            }
+
+            Entry * e = entries();
+            unsigned int first = 0, last;
+            while(first < _count && _compare(e[first].key, lo))
+                first++;
+            for(last = first; last < _count && !_compare(hi, e[last].key); last++)
+                new(range.entries() + range._count++) Entry(std::move(e[last]));
+
+            removeInline(first, last);
+            return range;
+        }
+
+        /**
+         *	Removes the (key, value) pair with the smallest key and returns it. Among
+         *	equal keys, the oldest pair goes first.
+         */
+        Entry popMin()
+        {
+            if(_tree)
+            {
+                Entry entry = _tree->popMin();
+                demoteIfSmall();
+                return entry;
+            }
+
+            if(_count == 0)
+                throw new std::runtime_error("AvlSmallTree::popMin() called on an empty tree.");
+
+            Entry entry(std::move(entries()[0]));
+            removeInline(0, 1);
+            return entry;
+        }
+
+        /**
+         *	Removes the (key, value) pair with the largest key and returns it. Among
+         *	equal keys, the newest pair goes first.
+         */
+        Entry popMax()
+        {
+            if(_tree)
+            {
+                Entry entry = _tree->popMax();
+                demoteIfSmall();
+                return entry;
+            }
+
+            if(_count == 0)
+                throw new std::runtime_error("AvlSmallTree::popMax() called on an empty tree.");
+
+            Entry entry(std::move(entries()[_count - 1]));
+            removeInline(_count - 1, _count);
+            return entry;
+        }
+
+        /**
+         *	Calls visit(key, value) for every pair, in order.
+         */
+        template<class Visitor>
+        void forEach(Visitor visit)
+        {
+            if(_tree)
+            {
+                for(typename Tree::Node * it = _tree->getLeftmost(); it; it = it->getNext())
+                    visit(static_cast<const Key&>(it->entry.key), it->entry.value);
+                return;
+            }
+
+            for(unsigned int i = 0; i < _count; i++)
+                visit(static_cast<const Key&>(entries()[i].key), entries()[i].value);
+        }
+
+        template<class Visitor>
+        void forEach(Visitor visit) const
+        {
+            if(_tree)
+            {
+                for(const typename Tree::Node * it = static_cast<const Tree *>(_tree)->getLeftmost(); it; it = it->getNext())
+                    visit(it->entry.key, it->entry.value);
+                return;
+            }
+
+            for(unsigned int i = 0; i < _count; i++)
+                visit(entries()[i].key, entries()[i].value);
+        }
+
+        unsigned long count(const Key& key) const
+        {
+            if(_tree)
+                return _tree->count(key);
+
+            unsigned long count = 0;
+            const Entry * e = entries();
+            for(unsigned int i = 0; i < _count && !_compare(key, e[i].key); i++)
+                if(!_compare(e[i].key, key))
+                    count++;
+
+            return count;
+        }
+
+        /**
+         *	Returns the number of (key, value) pairs stored into the tree.
+         */
+        unsigned long size() const { return _tree ? _tree->size() : _count; }
+
+        /**
+         *	The inline array counts as a single level.
+         */
+        unsigned int height() const { return _tree ? _tree->height() : (_count ? 1 : 0); }
+
+        /**
+         *	Returns true while the pairs are stored inline rather than in a tree.
+         */
+        bool isInline() const { return _tree == NULL; }
+
+    private:
+        Entry * entries() { return reinterpret_cast<Entry *>(&_inline); }
+        const Entry * entries() const { return reinterpret_cast<const Entry *>(&_inline); }
+
+        /**
+         *	Takes over the pairs of the other tree, leaving it empty.
+         */
+        void take(AvlSmallTree& other)
+        {
+            _tree = other._tree;
+            for(_count = 0; _count < other._count; _count++)
+                new(entries() + _count) Entry(std::move(other.entries()[_count]));
+
+            other.clearInline();
+            other._tree = NULL;
+        }
+
+        /**
+         *	Moves the inline pairs, which are already sorted, into a new tree.
+         */
+        void promote()
+        {
+            _tree = new Tree();
+            _tree->assignSorted(entries(), entries() + _count);
+            clearInline();
+        }
+
+        /**
+         *	Moves the pairs of the tree back inline once few enough are left.
+         */
+        void demoteIfSmall()
+        {
+            if(_tree->size() > N / 2)
+                return;
+
+            for(typename Tree::Node * it = _tree->getLeftmost(); it; it = it->getNext())
+                new(entries() + _count++) Entry(std::move(it->entry));
+
+            delete _tree;
+            _tree = NULL;
+        }
+
+        /**
+         *	Removes the inline pairs in [first, last) and shifts the rest down.
+         */
+        void removeInline(unsigned int first, unsigned int last)
+        {
+            Entry * e = entries();
+            unsigned int removed = last - first;
+
+            for(unsigned int i = first; i + removed < _count; i++)
+                e[i] = std::move(e[i + removed]);
+
+            for(unsigned int i = _count - removed; i < _count; i++)
+                e[i].~Entry();
+
+            _count -= removed;
+        }
+
+        void clearInline()
+        {
+            for(unsigned int i = 0; i < _count; i++)
+                entries()[i].~Entry();
+            _count = 0;
+        }
+
+    private:
+        /**
+         *	Storage for N inline pairs, of which the first _count are constructed.
+         */
+        typename std::aligned_storage<sizeof(Entry) * N, alignof(Entry)>::type _inline;
+
+        /**
+         *	The tree holding the pairs once there are too many to keep inline.
+         */
+        Tree * _tree;
+        unsigned int _count;
+
+        Compare _compare;
+};
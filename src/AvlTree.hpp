@@ -9,22 +9,70 @@
 
 #include <AvlNode.hpp>
 
+#include <algorithm>
+#include <climits>
+#include <cstdint>
 #include <functional>
 #include <iosfwd>
+#include <memory>
+#include <new>
+#include <utility>
+#include <vector>
 
 /**
  *	This class declares and implements an AVL tree, a balanced binary tree
  *	that provides logarithmic insertion, deletion and lookup time.
+ *
+ *	Equal keys are allowed and are kept in insertion order: a new key is
+ *	always placed after the keys that compare equal to it. Pass AvlSizeAugment
+ *	as the Augment to make count(key) logarithmic, or use AvlMultiTree to
+ *	store all the values of a key in a single node.
  */
-template<class Key, class Value, class Compare = std::less<Key> >
+template<class Key, class Value, class Compare = std::less<Key>, class Augment = AvlNoAugment>
 class AvlTree
 {
     protected:
-        typedef AvlTree<Key, Value, Compare> Tree;
-        typedef AvlNode<Key, Value> Node;
+        typedef AvlTree<Key, Value, Compare, Augment> Tree;
         
     public:
-        AvlTree() : _root(NULL), _size(0) {}
+        typedef AvlNode<Key, Value, Augment> Node;
+        typedef AvlEntry<Key, Value> Entry;
+        
+    public:
+        AvlTree()
+            :	_root(NULL), _size(0), _leftmost(NULL), _rightmost(NULL)
+        {}
+        
+        /**
+         *	For comparators that carry state.
+         */
+        explicit AvlTree(const Compare& compare)
+            :	_compare(compare), _root(NULL), _size(0), _leftmost(NULL), _rightmost(NULL)
+        {}
+        
+        /**
+         *	Trees own their nodes, so they can be moved but not copied.
+         */
+        AvlTree(Tree&& other)
+            :	_root(NULL), _size(0), _leftmost(NULL), _rightmost(NULL)
+        {
+            avlTake(other);
+        }
+        
+        AvlTree(const Tree&) = delete;
+        Tree& operator=(const Tree&) = delete;
+        
+        Tree& operator=(Tree&& other)
+        {
+            if(this != &other)
+            {
+                avlFree(_root);
+                avlTake(other);
+            }
+            return *this;
+        }
+        
+        ~AvlTree() { avlFree(_root); }
     
     public:
         /**
@@ -58,6 +106,26 @@ class AvlTree
         }
         
     protected:
+        /**
+         *	Takes over the nodes of the other tree, leaving it empty.
+         */
+        void avlTake(Tree& other)
+        {
+            _compare = other._compare;
+            _root = other._root;
+            _size = other._size;
+            _leftmost = other._leftmost;
+            _rightmost = other._rightmost;
+            _relaxed = std::move(other._relaxed);
+            _slabs = std::move(other._slabs);
+            _hot = std::move(other._hot);
+            
+            other._root = NULL;
+            other._size = 0;
+            other._leftmost = other._rightmost = NULL;
+            other._slabs.clear();
+        }
+        
         /**
          *	Inserts the new node into the AVL tree. First, it finds the spot in 
          *	the tree for the new node. Second, it updates the balance factors
@@ -72,86 +140,185 @@ class AvlTree
              */
             Node * it = _root, * parent;
             int idx;
+            unsigned int depth = 0;
             
             do
             {
                 parent = it;
-                // TODO: duplicate keys handle
+                /**
+                 *	Equal keys go right, so duplicates stay in insertion order.
+                 */
                 idx = lessThan(newNode, it) ? 0 : 1;
                 
                 it = it->child[idx];
+                depth++;
             } while(it);
             
             /**
              *	We found the place for the new node in the tree.
              */
+            avlAttach(newNode, parent, idx, depth);
+        }
+        
+        /**
+         *	Hangs the new node as the specified (empty) child of the parent and
+         *	rebalances the tree. The depth of the new node is only needed in
+         *	relaxed balance mode.
+         */
+        void avlAttach(Node * newNode, Node * parent, unsigned int idx, unsigned int depth = 0)
+        {
             parent->setChild(newNode, idx);
             
-            /**
-             *	Now we must update the balances of all the ancestors of our new node,
-             *	until one of the new balance factors becomes zero or we reach the root node.
-             *
-             *	We also stop when we update a balance to 2 or -2 because this balance will
-             *	become 0 after rebalancing, which implies higher ancestors will keep their
-             *	current balance factors.
-             */
-            Node * ancestor = newNode;
+            if(idx == 0 && parent == _leftmost)
+                _leftmost = newNode;
+            else if(idx == 1 && parent == _rightmost)
+                _rightmost = newNode;
+            
+            if(Augment::enabled)
+                avlUpdatePath(newNode);
+            
+            if(_relaxed)
+            {
+                _relaxed->pending.push_back(newNode);
+                
+                /**
+                 *	Catch up as soon as the new node lies deeper than any node of an
+                 *	AVL tree of this size could, so that e.g. sorted keys cannot turn
+                 *	the tree into a list. Past RELAXED_MAX_PENDING queued nodes, every
+                 *	insert rebalances two more nodes per RELAXED_MAX_PENDING queued, so
+                 *	the queue shrinks again without a single insert draining it all.
+                 */
+                unsigned long queued = _relaxed->pending.size() - _relaxed->head;
+                
+                if(depth > avlHeightLimit())
+                    rebalance();
+                else if(queued > RELAXED_MAX_PENDING)
+                    rebalance(_relaxed->steps + 2 * (queued / RELAXED_MAX_PENDING));
+                else
+                    rebalance(_relaxed->steps);
+            }
+            else
+                avlGrow(newNode);
+        }
+        
+        /**
+         *	Returns an upper bound on the height of an AVL tree of the current size,
+         *	1.5 log2(n + 2) + 2, which is a little above the actual 1.44 log2(n + 2).
+         */
+        unsigned int avlHeightLimit() const
+        {
+            unsigned int bits = 0;
+            for(unsigned long n = _size + 2; n > 1; n >>= 1)
+                bits++;
+            
+            return bits * 3 / 2 + 2;
+        }
+        
+        /**
+         *	Called after the subtree rooted at the specified node grew by one level.
+         *	Returns true if the whole tree (or detached subtree) grew as well.
+         *
+         *	We must update the balances of all the ancestors of the node, until one 
+         *	of the new balance factors becomes zero or we reach the root node.
+         *
+         *	We also stop when we update a balance to 2 or -2 because this balance will
+         *	become 0 after rebalancing, which implies higher ancestors will keep their
+         *	current balance factors.
+         */
+        bool avlGrow(Node * node)
+        {
+            Node * ancestor = node;
             Node * child;
             
             do {
                 child = ancestor;
                 ancestor = ancestor->parent;
                 
+                if(ancestor == NULL)
+                    return true;
+                
                 ancestor->balance += ancestor->isLeftChild(child) ? -1 : 1;
                 
-            } while((ancestor->balance == 1 || ancestor->balance == -1) && ancestor != _root);
+            } while(ancestor->balance == 1 || ancestor->balance == -1);
             
-            /**
-             *	Balance the tree, unless the newly inserted node does not have a ancestor,
-             *	in which case the tree is too small to be rebalanced.
-             */
-            if(newNode->parent != _root)
-                avlBalance(ancestor);
+            avlBalance(ancestor);
+            return false;
+        }
+        
+        /**
+         *	Called after the specified child subtree of the ancestor shrank by one
+         *	level. Updates the balances of the ancestors and rotates where needed.
+         *	Unlike insertions, a removal can require a rotation at every level.
+         */
+        void avlShrink(Node * ancestor, unsigned int side)
+        {
+            while(ancestor)
+            {
+                ancestor->balance += side ? -1 : 1;
+                
+                /**
+                 *	The ancestor used to be balanced, so its height did not change.
+                 */
+                if(ancestor->balance == 1 || ancestor->balance == -1)
+                    return;
+                
+                if(ancestor->balance != 0)
+                {
+                    int siblingBalance = ancestor->child[side ? 0 : 1]->balance;
+                    ancestor = avlBalance(ancestor);
+                    
+                    /**
+                     *	A single rotation around a balanced sibling keeps the height.
+                     */
+                    if(siblingBalance == 0)
+                        return;
+                }
+                
+                Node * child = ancestor;
+                ancestor = ancestor->parent;
+                if(ancestor)
+                    side = ancestor->getChildIndex(child);
+            }
         }
         
         /**
          *	Checks if there are any nodes with balance factors of 2 or -2, in which case
-         *	the subtree needs to be rotated at that node.
+         *	the subtree needs to be rotated at that node. Returns the new root of
+         *	the subtree.
          *
          *	The rotation and balance factor "magic" is explained in the documentation thoroughly.
          */
-        void avlBalance(Node * ancestor)
+        Node * avlBalance(Node * ancestor)
         {
             if(ancestor->balance == -2)
             {
-                if(ancestor->getLeft()->balance == -1)
-                {
-                    avlSingleRotation(ancestor, 0);
-                }
-                else if(ancestor->getLeft()->balance == 1)
+                if(ancestor->getLeft()->balance == 1)
                 {
                     avlDoubleRotation(ancestor, 0);
                 }
                 else
                 {
-                    throw new std::runtime_error("AvlTree::avlBalance(Node *) inconsistency detected.");
+                    /**
+                     *	The left child is -1 after an insertion, and -1 or 0 after a removal.
+                     */
+                    avlSingleRotation(ancestor, 0);
                 }
+                return ancestor->parent;
             }
             else if(ancestor->balance == 2)
             {
-                if(ancestor->getRight()->balance == 1)
-                {
-                    avlSingleRotation(ancestor, 1);
-                }
-                else if(ancestor->getRight()->balance == -1)
+                if(ancestor->getRight()->balance == -1)
                 {
                     avlDoubleRotation(ancestor, 1);
                 }
                 else
                 {
-                    throw new std::runtime_error("AvlTree::avlBalance(Node *) inconsistency detected.");
+                    avlSingleRotation(ancestor, 1);
                 }
+                return ancestor->parent;
             }
+            
+            return ancestor;
         }
         
         /**
@@ -176,6 +343,8 @@ class AvlTree
             Node * oldRootParent = p->parent;
             if(oldRootParent)
                 oldRootParent->replaceChild(p, q);
+            else
+                q->parent = NULL;
 
             q->setChild(p, opposed);
             
@@ -185,8 +354,23 @@ class AvlTree
                 _root->parent = 0;
             }
             
-            p->balance = 0;
-            q->balance = 0;
+            /**
+             *	Q can only be balanced when rotating after a removal, in which case
+             *	the subtree keeps its height and both nodes stay unbalanced.
+             */
+            if(q->balance == 0)
+            {
+                p->balance = dir ? 1 : -1;
+                q->balance = -p->balance;
+            }
+            else
+            {
+                p->balance = 0;
+                q->balance = 0;
+            }
+            
+            avlUpdate(p);
+            avlUpdate(q);
         }
         
         /**
@@ -210,6 +394,8 @@ class AvlTree
             Node * pParent = p->parent;
             if(pParent)
                 pParent->replaceChild(p, r);
+            else
+                r->parent = NULL;
             
             p->setChild(r->getChild(opposed), dir);
             q->setChild(r->getChild(dir), opposed);
@@ -244,102 +430,1272 @@ class AvlTree
             }
             
             r->balance = 0;
+            
+            avlUpdate(p);
+            avlUpdate(q);
+            avlUpdate(r);
         }
         
-        unsigned int avlHeight(const Node * root) const {
-            if(root)
-                return 1 + std::max(avlHeight(root->getLeft()), avlHeight(root->getRight()));
+        /**
+         *	Unlinks the node from the tree and rebalances it. The node is not freed.
+         */
+        void avlRemove(Node * node)
+        {
+            Node * start;
+            unsigned int side;
+            
+            if(node == _leftmost)
+                _leftmost = node->getNext();
+            if(node == _rightmost)
+                _rightmost = node->getPrev();
+            
+            if(node->child[0] && node->child[1])
+            {
+                /**
+                 *	The in-order successor has no left child, so it can be unlinked
+                 *	easily and then moved in place of the node. Moving the node itself,
+                 *	rather than its entry, keeps pointers to other nodes valid.
+                 */
+                Node * next = node->child[1];
+                while(next->child[0])
+                    next = next->child[0];
+                
+                if(next->parent == node)
+                {
+                    start = next;
+                    side = 1;
+                }
+                else
+                {
+                    start = next->parent;
+                    side = 0;
+                    start->setChild(next->child[1], 0);
+                    next->setChild(node->child[1], 1);
+                }
+                
+                next->setChild(node->child[0], 0);
+                next->balance = node->balance;
+                avlReplace(node, next);
+            }
             else
-                return 0;
+            {
+                start = node->parent;
+                side = start ? start->getChildIndex(node) : 0;
+                avlReplace(node, node->child[0] ? node->child[0] : node->child[1]);
+            }
+            
+            node->child[0] = node->child[1] = node->parent = NULL;
+            node->balance = 0;
+            
+            if(Augment::enabled)
+                avlUpdatePath(start);
+            
+            avlShrink(start, side);
         }
-
-    public:
+        
         /**
-         *	Looks for the value associated with the specified key in the tree
-         *	and returns a pointer to the value or null if such a (key, value) 
-         *	pair was not inserted in the tree.
+         *	Unlinks the leftmost (dir = 0) or rightmost (dir = 1) node and returns it.
+         *	An extreme node has at most one child, a leaf on the inner side, which
+         *	simply takes its place and becomes the new extreme, so there is no
+         *	successor to look for and the retrace starts on the spine. Removals at
+         *	one end of an AVL tree only rebalance in amortized O(1) time.
          */
-        Value * find(const Key& key)
+        Node * avlRemoveExtreme(unsigned int dir)
         {
-            assert((_root != NULL && _size != 0) || (_size == 0 && _root == NULL));
-            Node * it = _root;
-
+            Node * node = dir ? _rightmost : _leftmost;
+            Node * inner = node->child[dir ? 0 : 1];
+            Node * parent = node->parent;
+            
+            avlReplace(node, inner);
+            (dir ? _rightmost : _leftmost) = inner ? inner : parent;
             if(_root == NULL)
-                return NULL;
+                _leftmost = _rightmost = NULL;
             
-            do
-            {
-                if(_compare(key, it->entry.key))
-                    it = it->child[0];
-                else if(_compare(it->entry.key, key))
-                    it = it->child[1];
-                else
-                    return &(it->entry.value);
-            } while(it);
+            node->child[0] = node->child[1] = node->parent = NULL;
+            node->balance = 0;
             
-            return NULL;
+            if(Augment::enabled)
+                avlUpdatePath(parent);
+            
+            avlShrink(parent, dir);
+            return node;
         }
         
-        const Value * find(const Key& key) const
+        /**
+         *	Removes the leftmost (dir = 0) or rightmost (dir = 1) pair and returns it.
+         */
+        Entry avlPop(unsigned int dir)
+        {
+            if(_root == NULL)
+                throw new std::runtime_error("AvlTree::popMin() or AvlTree::popMax() called on an empty tree.");
+            
+            rebalance();
+            Node * node = avlRemoveExtreme(dir);
+            avlHotDrop(node);
+            _size--;
+            
+            Entry entry(std::move(node->entry));
+            avlDelete(node);
+            return entry;
+        }
+        
+        /**
+         *	Puts the new node (or subtree) in place of the old one.
+         */
+        void avlReplace(Node * oldNode, Node * newNode)
         {
-            return find(key);
+            Node * parent = oldNode->parent;
+            
+            if(parent)
+                parent->replaceChild(oldNode, newNode);
+            else
+            {
+                _root = newNode;
+                if(newNode)
+                    newNode->parent = NULL;
+            }
         }
         
         /**
-         *	Inserts the specified (key, value) pair into the tree.
+         *	Joins the two detached subtrees of the specified heights, where all the keys
+         *	in the left one precede the key of the middle node and all the keys in the
+         *	right one follow it. Returns the root of the result and its height.
+         *
+         *	Costs O(|leftHeight - rightHeight| + 1): the middle node is hung off the
+         *	spine of the taller subtree, at the first node not much taller than the
+         *	shorter subtree, and the ancestors are fixed like after an insertion.
          */
-        void insert(const Key& key, const Value& value)
-        { 
-            _size++;
+        Node * avlJoin(Node * left, int leftHeight, Node * middle, Node * right, int rightHeight, int& height)
+        {
+            if(leftHeight - rightHeight <= 1 && rightHeight - leftHeight <= 1)
+            {
+                middle->parent = NULL;
+                middle->setChild(left, 0);
+                middle->setChild(right, 1);
+                middle->balance = rightHeight - leftHeight;
+                avlUpdate(middle);
+                
+                height = std::max(leftHeight, rightHeight) + 1;
+                return middle;
+            }
+            
+            unsigned int dir = leftHeight > rightHeight ? 1 : 0;
+            unsigned int opposed = dir ? 0 : 1;
+            Node * top = dir ? left : right;
+            int tallHeight = dir ? leftHeight : rightHeight;
+            int shortHeight = dir ? rightHeight : leftHeight;
+            
+            Node * spine = top, * spineParent = NULL;
+            int spineHeight = tallHeight;
+            while(spineHeight > shortHeight + 1)
+            {
+                spineHeight -= (spine->balance == (dir ? -1 : 1)) ? 2 : 1;
+                spineParent = spine;
+                spine = spine->child[dir];
+            }
+            
+            middle->setChild(spine, opposed);
+            middle->setChild(dir ? right : left, dir);
+            middle->balance = dir ? shortHeight - spineHeight : spineHeight - shortHeight;
+            spineParent->setChild(middle, dir);
+            
+            if(Augment::enabled)
+                avlUpdatePath(middle);
+            
+            height = tallHeight + (avlGrow(middle) ? 1 : 0);
             
             /**
-             *	The basic case arises when the tree is empty. In this case
-             *	we'll create a new node and set it as the root of the tree.
+             *	At most one rotation happened, possibly at the top of the taller subtree.
              */
-            if(_root == NULL)
-                _root = new Node(key, value);
-            else
+            return top->parent ? top->parent : top;
+        }
+        
+        /**
+         *	Splits the detached subtree containing the specified node into the nodes
+         *	that precede it and the nodes that follow it, in O(log n) time, by walking
+         *	up from the node and joining the ancestors into either side. The node itself
+         *	is left isolated.
+         */
+        void avlSplit(Node * node, Node *& left, int& leftHeight, Node *& right, int& rightHeight)
+        {
+            int height = avlSpineHeight(node);
+            
+            left = node->child[0];
+            right = node->child[1];
+            leftHeight = height - (node->balance > 0 ? 2 : 1);
+            rightHeight = height - (node->balance < 0 ? 2 : 1);
+            
+            if(left)
+                left->parent = NULL;
+            if(right)
+                right->parent = NULL;
+            
+            Node * child = node;
+            Node * ancestor = node->parent;
+            
+            node->child[0] = node->child[1] = node->parent = NULL;
+            node->balance = 0;
+            avlUpdate(node);
+            
+            while(ancestor)
             {
                 /**
-                 *	Create an isolated node and insert it into the tree.
+                 *	The ancestor gets reused as the middle node of a join, so read
+                 *	everything we need from it first.
                  */
-                avlInsert(new Node(key, value));
+                Node * next = ancestor->parent;
+                unsigned int side = ancestor->getChildIndex(child);
+                Node * sibling = ancestor->child[side ? 0 : 1];
+                int siblingHeight = side ? height - ancestor->balance : height + ancestor->balance;
+                
+                if(sibling)
+                    sibling->parent = NULL;
+                
+                if(side)
+                    left = avlJoin(sibling, siblingHeight, ancestor, left, leftHeight, leftHeight);
+                else
+                    right = avlJoin(right, rightHeight, ancestor, sibling, siblingHeight, rightHeight);
+                
+                height = std::max(height, siblingHeight) + 1;
+                child = ancestor;
+                ancestor = next;
             }
         }
         
-        Value remove(const Key& key)
+        /**
+         *	Computes the height of a subtree in O(log n) by following its taller children.
+         */
+        int avlSpineHeight(const Node * root) const
+        {
+            int height = 0;
+            
+            for(; root; height++)
+                root = root->child[root->balance < 0 ? 0 : 1];
+            
+            return height;
+        }
+        
+        /**
+         *	Builds a perfectly balanced tree out of n sorted entries and returns its
+         *	root and its height.
+         */
+        template<class It>
+        Node * avlBuild(It first, unsigned long n, int& height)
         {
-            key;
-            throw new std::runtime_error("Not implemented");
+            if(n == 0)
+            {
+                height = 0;
+                return NULL;
+            }
+            
+            int leftHeight, rightHeight;
+            unsigned long mid = n / 2;
+            
+            Node * node = new Node(first[mid].key, first[mid].value);
+            node->setChild(avlBuild(first, mid, leftHeight), 0);
+            node->setChild(avlBuild(first + mid + 1, n - mid - 1, rightHeight), 1);
+            node->balance = rightHeight - leftHeight;
+            avlUpdate(node);
+            
+            height = std::max(leftHeight, rightHeight) + 1;
+            return node;
         }
-
+        
         /**
-         *	Returns the number of (key, value) pairs stored into the tree.
+         *	Walks down the spines of the tree to find its leftmost and rightmost nodes.
          */
-        unsigned long size() const { return _size; }
+        void avlFindExtremes()
+        {
+            _leftmost = _rightmost = _root;
+            
+            while(_leftmost && _leftmost->child[0])
+                _leftmost = _leftmost->child[0];
+            while(_rightmost && _rightmost->child[1])
+                _rightmost = _rightmost->child[1];
+        }
         
-        unsigned int height() const
+        /**
+         *	Frees all the nodes in the subtree, without recursion, and returns their number.
+         */
+        unsigned long avlFree(Node * root)
         {
-            return avlHeight(_root);
+            unsigned long freed = 0;
+            Node * it = root;
+            
+            while(it)
+            {
+                if(it->child[0])
+                    it = it->child[0];
+                else if(it->child[1])
+                    it = it->child[1];
+                else
+                {
+                    Node * parent = (it == root) ? NULL : it->parent;
+                    if(parent)
+                        parent->child[parent->child[0] == it ? 0 : 1] = NULL;
+                    
+                    avlDelete(it);
+                    freed++;
+                    it = parent;
+                }
+            }
+            
+            return freed;
         }
-
-        Node * getRoot() { return _root; }
-        const Node * getRoot() const { return _root; }
-
-    protected:
+        
         /**
-         *	The comparator object takes in two keys as parameters and returns
-         *	true if the first one is less than the second one and false otherwise.
+         *	Destroys the node and frees its memory, unless it lives in a slab.
          */
-        Compare _compare;
+        void avlDelete(Node * node)
+        {
+            for(size_t i = 0; i < _slabs.size(); i++)
+            {
+                if(node >= _slabs[i].begin && node < _slabs[i].end)
+                {
+                    node->~Node();
+                    return;
+                }
+            }
+            
+            delete node;
+        }
+        
+        static void avlFreeSlab(void * memory) { ::operator delete(memory); }
         
         /**
-         *	Pointer to the root of the tree.
+         *	Lists the nodes in van Emde Boas order: the top half of the levels first,
+         *	recursively, followed by each of the subtrees hanging below them, also
+         *	recursively. Every subtree of about sqrt(n) nodes is then contiguous, so
+         *	a lookup touches O(log n / log B) blocks of B nodes, whatever B is.
          */
-        Node * _root;
+        void avlVanEmdeBoas(Node * root, int height, std::vector<Node *>& order)
+        {
+            if(root == NULL)
+                return;
+            
+            if(height == 1)
+            {
+                order.push_back(root);
+                return;
+            }
+            
+            int top = height / 2;
+            avlVanEmdeBoas(root, top, order);
+            
+            std::vector<Node *> bottoms;
+            avlCollectLevel(root, top, bottoms);
+            
+            for(size_t i = 0; i < bottoms.size(); i++)
+                avlVanEmdeBoas(bottoms[i], height - top, order);
+        }
         
         /**
-         *	The size of the tree -- the number of nodes.
+         *	Lists the nodes exactly depth levels below the root, from left to right.
          */
-        unsigned long _size;
+        void avlCollectLevel(Node * root, int depth, std::vector<Node *>& level)
+        {
+            if(root == NULL)
+                return;
+            
+            if(depth == 0)
+                level.push_back(root);
+            else
+            {
+                avlCollectLevel(root->child[0], depth - 1, level);
+                avlCollectLevel(root->child[1], depth - 1, level);
+            }
+        }
+        
+        unsigned long avlSubtreeSize(const Node * root, const AvlSizeAugment *) const
+        {
+            return AvlSizeAugment::size(root);
+        }
+        
+        template<class OtherAugment>
+        unsigned long avlSubtreeSize(const Node * root, const OtherAugment *) const
+        {
+            if(root == NULL)
+                return 0;
+            
+            return 1 + avlSubtreeSize(root->getLeft(), static_cast<const OtherAugment *>(NULL)) +
+                avlSubtreeSize(root->getRight(), static_cast<const OtherAugment *>(NULL));
+        }
+        
+        /**
+         *	Detaches all the nodes with keys in [lo, hi] from the tree and returns
+         *	the root of the detached subtree, or null if there are no such keys.
+         */
+        Node * avlDetachRange(const Key& lo, const Key& hi)
+        {
+            rebalance();
+            avlHotClear();
+            
+            Node * first = avlBound(lo, false);
+            Node * last = avlBound(hi, true);
+            
+            if(first == NULL || first == last || (last && _compare(last->entry.key, first->entry.key)))
+                return NULL;
+            
+            /**
+             *	Work on the detached tree, so rotations at its top don't touch _root.
+             */
+            Node * root = _root;
+            _root = NULL;
+            
+            Node * before, * range, * after = NULL, * rest;
+            int beforeHeight, rangeHeight, afterHeight = 0, restHeight, height;
+            
+            if(last)
+                avlSplit(last, rest, restHeight, after, afterHeight);
+            else
+            {
+                rest = root;
+                restHeight = avlSpineHeight(root);
+            }
+            
+            avlSplit(first, before, beforeHeight, range, rangeHeight);
+            range = avlJoin(NULL, 0, first, range, rangeHeight, height);
+            
+            if(last)
+                root = avlJoin(before, beforeHeight, last, after, afterHeight, height);
+            else
+                root = before;
+            
+            _root = root;
+            if(_root)
+                _root->parent = NULL;
+            
+            avlFindExtremes();
+            return range;
+        }
+        
+        /**
+         *	Recomputes the augmented data of the node from its children.
+         */
+        void avlUpdate(Node * node)
+        {
+            if(Augment::enabled)
+                Augment::update(node);
+        }
+        
+        /**
+         *	Recomputes the augmented data of the node and of all its ancestors.
+         */
+        void avlUpdatePath(Node * node)
+        {
+            for(; node; node = node->parent)
+                avlUpdate(node);
+        }
+        
+        /**
+         *	Looks for a node with the specified key, or returns null if there is none.
+         */
+        Node * avlFind(const Key& key) const
+        {
+            assert((_root != NULL && _size != 0) || (_size == 0 && _root == NULL));
+            Node * it = _root;
+            
+            while(it)
+            {
+                if(_compare(key, it->entry.key))
+                    it = it->child[0];
+                else if(_compare(it->entry.key, key))
+                    it = it->child[1];
+                else
+                    return it;
+            }
+            
+            return NULL;
+        }
+        
+        /**
+         *	Looks the key up in the hot cache first, then in the tree. Every lookup
+         *	is counted in the sketch, and a key found in the tree is admitted into
+         *	its bucket if the sketch says it is looked up more often than the key
+         *	it would evict.
+         */
+        Node * avlHotFind(const Key& key) const
+        {
+            uint64_t hash = avlHotMix(_hot->hash(key));
+            AvlHotBucket& bucket = _hot->buckets[hash & _hot->mask];
+            unsigned int frequency = avlHotCount(hash);
+            
+            for(unsigned int i = 0; i < HOT_WAYS; i++)
+            {
+                Node * node = bucket.node[i];
+                if(node && bucket.hash[i] == hash && !_compare(key, node->entry.key) && !_compare(node->entry.key, key))
+                {
+                    _hot->hits++;
+                    return node;
+                }
+            }
+            
+            _hot->misses++;
+            Node * node = avlFind(key);
+            if(node == NULL)
+                return NULL;
+            
+            unsigned int victim = 0, victimFrequency = UINT_MAX;
+            for(unsigned int i = 0; i < HOT_WAYS && victimFrequency > 0; i++)
+            {
+                unsigned int f = bucket.node[i] ? avlHotEstimate(bucket.hash[i]) : 0;
+                if(f < victimFrequency)
+                {
+                    victim = i;
+                    victimFrequency = f;
+                }
+            }
+            
+            if(frequency > victimFrequency)
+            {
+                bucket.node[victim] = node;
+                bucket.hash[victim] = hash;
+            }
+            
+            return node;
+        }
+        
+        /**
+         *	Drops the node from the hot cache, before it is removed from the tree.
+         */
+        void avlHotDrop(const Node * node)
+        {
+            if(!_hot)
+                return;
+            
+            AvlHotBucket& bucket = _hot->buckets[avlHotMix(_hot->hash(node->entry.key)) & _hot->mask];
+            for(unsigned int i = 0; i < HOT_WAYS; i++)
+                if(bucket.node[i] == node)
+                    bucket.node[i] = NULL;
+        }
+        
+        /**
+         *	Empties the hot cache, before many nodes are removed or moved at once.
+         *	The sketch is kept, since it counts keys rather than nodes.
+         */
+        void avlHotClear()
+        {
+            if(_hot)
+                std::fill(_hot->buckets, _hot->buckets + _hot->mask + 1, AvlHotBucket());
+        }
+        
+        template<class Hash>
+        static size_t avlHotHash(const Key& key) { return Hash()(key); }
+        
+        /**
+         *	Hashes like std::hash<long> return the key itself, so the bits are mixed
+         *	before picking buckets and counters from them.
+         */
+        static uint64_t avlHotMix(uint64_t hash)
+        {
+            hash ^= hash >> 33;
+            hash *= 0xff51afd7ed558ccdULL;
+            hash ^= hash >> 33;
+            return hash;
+        }
+        
+        /**
+         *	Every row remixes the hash with its own seed, so keys that share a
+         *	counter in one row are unlikely to share one in the others.
+         */
+        uint8_t& avlHotCounter(uint64_t hash, unsigned int row) const
+        {
+            static const uint64_t seeds[HOT_ROWS] = {
+                0x9e3779b97f4a7c15ULL, 0xc2b2ae3d27d4eb4fULL, 0x165667b19e3779f9ULL, 0x27d4eb2f165667c5ULL
+            };
+            
+            uint64_t index = avlHotMix(hash ^ seeds[row]) >> 32;
+            return _hot->sketch[row * (_hot->sketchMask + 1) + (index & _hot->sketchMask)];
+        }
+        
+        /**
+         *	Returns the count-min estimate of how often the key was looked up.
+         */
+        unsigned int avlHotEstimate(uint64_t hash) const
+        {
+            unsigned int estimate = UINT8_MAX;
+            for(unsigned int row = 0; row < HOT_ROWS; row++)
+                estimate = std::min<unsigned int>(estimate, avlHotCounter(hash, row));
+            return estimate;
+        }
+        
+        /**
+         *	Counts a lookup of the key and returns its new estimate. The counters
+         *	are halved every 8 lookups per counter, so keys that were hot a while
+         *	ago fade away.
+         */
+        unsigned int avlHotCount(uint64_t hash) const
+        {
+            for(unsigned int row = 0; row < HOT_ROWS; row++)
+            {
+                uint8_t& counter = avlHotCounter(hash, row);
+                if(counter < UINT8_MAX)
+                    counter++;
+            }
+            
+            if(++_hot->samples >= 8 * (_hot->sketchMask + 1))
+            {
+                for(size_t i = 0; i < HOT_ROWS * (_hot->sketchMask + 1); i++)
+                    _hot->sketch[i] /= 2;
+                _hot->samples = 0;
+            }
+            
+            return avlHotEstimate(hash);
+        }
+        
+        /**
+         *	Returns the first node whose key is not less than (or, if strict,
+         *	greater than) the specified key, or null if there is no such node.
+         */
+        Node * avlBound(const Key& key, bool strict) const
+        {
+            Node * it = _root, * bound = NULL;
+            
+            while(it)
+            {
+                bool goLeft = strict ? _compare(key, it->entry.key) : !_compare(it->entry.key, key);
+                if(goLeft)
+                {
+                    bound = it;
+                    it = it->child[0];
+                }
+                else
+                    it = it->child[1];
+            }
+            
+            return bound;
+        }
+        
+        /**
+         *	Returns the number of keys less than (or, if strict, less than or
+         *	equal to) the specified key. Only available with AvlSizeAugment.
+         */
+        unsigned long avlRank(const Key& key, bool strict) const
+        {
+            unsigned long rank = 0;
+            const Node * it = _root;
+            
+            while(it)
+            {
+                bool goLeft = strict ? _compare(key, it->entry.key) : !_compare(it->entry.key, key);
+                if(goLeft)
+                    it = it->child[0];
+                else
+                {
+                    rank += AvlSizeAugment::size(it->getLeft()) + 1;
+                    it = it->child[1];
+                }
+            }
+            
+            return rank;
+        }
+        
+        unsigned long avlCount(const Key& key, const AvlSizeAugment *) const
+        {
+            return avlRank(key, true) - avlRank(key, false);
+        }
+        
+        template<class OtherAugment>
+        unsigned long avlCount(const Key& key, const OtherAugment *) const
+        {
+            unsigned long count = 0;
+            Node * last = avlBound(key, true);
+            
+            for(Node * it = avlBound(key, false); it != last; it = it->getNext())
+                count++;
+            
+            return count;
+        }
+        
+        unsigned int avlHeight(const Node * root) const {
+            if(root)
+                return 1 + std::max(avlHeight(root->getLeft()), avlHeight(root->getRight()));
+            else
+                return 0;
+        }
+
+    public:
+        /**
+         *	Looks for the value associated with the specified key in the tree
+         *	and returns a pointer to the value or null if such a (key, value) 
+         *	pair was not inserted in the tree.
+         */
+        Value * find(const Key& key)
+        {
+            Node * node = _hot ? avlHotFind(key) : avlFind(key);
+            return node ? &node->entry.value : NULL;
+        }
+        
+        const Value * find(const Key& key) const
+        {
+            Node * node = _hot ? avlHotFind(key) : avlFind(key);
+            return node ? &node->entry.value : NULL;
+        }
+        
+        /**
+         *	Returns the first node whose key is not less than the specified key,
+         *	or null if all the keys are smaller.
+         */
+        Node * lowerBound(const Key& key) { return avlBound(key, false); }
+        const Node * lowerBound(const Key& key) const { return avlBound(key, false); }
+        
+        /**
+         *	Returns the first node whose key is greater than the specified key,
+         *	or null if no key is greater.
+         */
+        Node * upperBound(const Key& key) { return avlBound(key, true); }
+        const Node * upperBound(const Key& key) const { return avlBound(key, true); }
+        
+        /**
+         *	Returns the [first, last) range of nodes whose keys are equal to the
+         *	specified key, in insertion order. Iterate with Node::getNext().
+         */
+        std::pair<Node *, Node *> equalRange(const Key& key)
+        {
+            return std::make_pair(avlBound(key, false), avlBound(key, true));
+        }
+        
+        /**
+         *	Returns the number of values stored under the specified key. This is
+         *	O(log n) with AvlSizeAugment and O(log n + count) otherwise.
+         */
+        unsigned long count(const Key& key) const
+        {
+            return avlCount(key, static_cast<const Augment *>(NULL));
+        }
+        
+        /**
+         *	Inserts the specified (key, value) pair into the tree and returns
+         *	its node.
+         */
+        Node * insert(const Key& key, const Value& value)
+        { 
+            _size++;
+            
+            /**
+             *	Create an isolated node and insert it into the tree.
+             */
+            Node * newNode = new Node(key, value);
+            
+            /**
+             *	The basic case arises when the tree is empty. In this case
+             *	we'll set the new node as the root of the tree.
+             */
+            if(_root == NULL)
+            {
+                _root = _leftmost = _rightmost = newNode;
+                avlUpdate(newNode);
+            }
+            else
+                avlInsert(newNode);
+            
+            return newNode;
+        }
+        
+        /**
+         *	Inserts the specified (key, value) pair into the tree, right after the
+         *	hint node if that is where the key belongs, and returns its node. Meant
+         *	for keys that arrive (nearly) sorted, passing the previously inserted
+         *	node as the hint.
+         *
+         *	When the key goes after the hint, before the smallest key or after the
+         *	largest one, the node is attached without descending from the root, so
+         *	the insert costs O(1) amortized plus the usual rebalancing walk (and
+         *	the walk to the root when the tree is augmented). Otherwise the hint is
+         *	ignored, and so it is in relaxed balance mode, which needs the depth
+         *	of every new node and only learns it by descending from the root.
+         */
+        Node * insert(Node * hint, const Key& key, const Value& value)
+        {
+            if(_root == NULL || _relaxed)
+                return insert(key, value);
+            
+            Node * newNode = new Node(key, value);
+            _size++;
+            
+            if(!_compare(key, _rightmost->entry.key))
+            {
+                avlAttach(newNode, _rightmost, 1);
+            }
+            else if(_compare(key, _leftmost->entry.key))
+            {
+                avlAttach(newNode, _leftmost, 0);
+            }
+            else if(hint && !_compare(key, hint->entry.key))
+            {
+                /**
+                 *	The hint is not the rightmost node, so it has a successor. The key
+                 *	goes between the two either as the right child of the hint or, if
+                 *	the hint has one, as the left child of the successor.
+                 */
+                Node * next = hint->getNext();
+                
+                if(!_compare(key, next->entry.key))
+                    avlInsert(newNode);
+                else if(hint->child[1])
+                    avlAttach(newNode, next, 0);
+                else
+                    avlAttach(newNode, hint, 1);
+            }
+            else
+            {
+                avlInsert(newNode);
+            }
+            
+            return newNode;
+        }
+        
+        /**
+         *	Removes the oldest (key, value) pair with the specified key from the tree
+         *	and returns its value.
+         */
+        Value remove(const Key& key)
+        {
+            Node * node = avlBound(key, false);
+            
+            if(node == NULL || _compare(key, node->entry.key))
+                throw new std::runtime_error("AvlTree::remove(const Key&) could not find specified key.");
+            
+            rebalance();
+            avlHotDrop(node);
+            avlRemove(node);
+            _size--;
+            
+            Value value = node->entry.value;
+            avlDelete(node);
+            return value;
+        }
+        
+        /**
+         *	Removes all the (key, value) pairs with keys in [lo, hi] and returns their
+         *	number. The range is split off the tree in O(log n) and then freed in bulk.
+         */
+        unsigned long eraseRange(const Key& lo, const Key& hi)
+        {
+            unsigned long erased = avlFree(avlDetachRange(lo, hi));
+            _size -= erased;
+            return erased;
+        }
+        
+        /**
+         *	Moves all the (key, value) pairs with keys in [lo, hi] into a new tree,
+         *	without copying them. The range is split off in O(log n) time, plus the
+         *	time to count its nodes unless the tree is built with AvlSizeAugment.
+         */
+        Tree extractRange(const Key& lo, const Key& hi)
+        {
+            Tree range(_compare);
+            range._root = avlDetachRange(lo, hi);
+            range._size = avlSubtreeSize(range._root, static_cast<const Augment *>(NULL));
+            range.avlFindExtremes();
+            
+            /**
+             *	The range may contain nodes that live in our slabs.
+             */
+            range._slabs = _slabs;
+            
+            _size -= range._size;
+            return range;
+        }
+
+        /**
+         *	Return the nodes with the smallest and the largest keys in O(1) time, or
+         *	null if the tree is empty, for trees used as (double-ended) priority queues.
+         */
+        Node * min() { return _leftmost; }
+        const Node * min() const { return _leftmost; }
+        Node * max() { return _rightmost; }
+        const Node * max() const { return _rightmost; }
+        
+        /**
+         *	Removes the (key, value) pair with the smallest key and returns it. Among
+         *	equal keys, the oldest pair goes first.
+         */
+        Entry popMin() { return avlPop(0); }
+        
+        /**
+         *	Removes the (key, value) pair with the largest key and returns it. Among
+         *	equal keys, the newest pair goes first.
+         */
+        Entry popMax() { return avlPop(1); }
+        
+        /**
+         *	Removes the (at most) k pairs with the smallest keys and appends them to
+         *	out in order. Returns the number of pairs removed. The pairs are split
+         *	off in O(log n) time and then freed in bulk, rather than rebalancing the
+         *	tree after every one of them.
+         */
+        unsigned long popMinN(unsigned long k, std::vector<Entry>& out)
+        {
+            rebalance();
+            avlHotClear();
+            
+            if(k >= _size)
+                k = _size;
+            
+            Node * next = _leftmost;
+            for(unsigned long i = 0; i < k; i++, next = next->getNext())
+                out.push_back(std::move(next->entry));
+            
+            if(next == NULL)
+            {
+                avlFree(_root);
+                _root = _leftmost = _rightmost = NULL;
+                _size = 0;
+                return k;
+            }
+            
+            if(k == 0)
+                return 0;
+            
+            /**
+             *	Work on the detached tree, so rotations at its top don't touch _root.
+             */
+            Node * before, * after;
+            int beforeHeight, afterHeight, height;
+            
+            _root = NULL;
+            avlSplit(next, before, beforeHeight, after, afterHeight);
+            _root = avlJoin(NULL, 0, next, after, afterHeight, height);
+            _root->parent = NULL;
+            
+            avlFree(before);
+            _leftmost = next;
+            _size -= k;
+            return k;
+        }
+        
+        /**
+         *	Replaces the contents of the tree with the entries (anything with key and
+         *	value members, e.g. AvlEntry) in the sorted random-access range. Builds
+         *	the tree bottom-up in O(n) time, instead of O(n log n) with insert().
+         */
+        template<class It>
+        void assignSorted(It first, It last)
+        {
+            int height;
+            
+            avlFree(_root);
+            avlHotClear();
+            if(_relaxed)
+            {
+                _relaxed->pending.clear();
+                _relaxed->head = 0;
+            }
+            _slabs.clear();
+            _size = last - first;
+            _root = avlBuild(first, _size, height);
+            avlFindExtremes();
+        }
+        
+        /**
+         *	In relaxed balance mode, inserts only attach the new node and queue it,
+         *	skipping the walk up the tree and the rotations, so bursts of inserts
+         *	are cheap. The queued nodes are then rebalanced a few at a time: up to
+         *	stepsPerInsert of them after every insert, plus whatever rebalance()
+         *	is asked to do. Until the queue is drained the tree is still a valid
+         *	binary search tree, but it can get deeper, so lookups get slower.
+         *
+         *	The nodes are rebalanced in insertion order, which guarantees that all
+         *	the ancestors of a node have been rebalanced before it. So each step is
+         *	exactly the rebalancing a regular insert would have done in a tree
+         *	without the nodes still queued, and the tree returns to full AVL shape
+         *	once the queue is empty.
+         *
+         *	Not much deeper than an AVL tree, though: as soon as an insert lands
+         *	deeper than an AVL tree of that size allows, or too many inserts are
+         *	queued, the whole queue is rebalanced.
+         *
+         *	Removals rebalance the whole tree first. Turning the mode off does too.
+         */
+        void setRelaxedBalance(bool relaxed, unsigned int stepsPerInsert = 0)
+        {
+            if(!relaxed)
+            {
+                rebalance();
+                _relaxed.reset();
+                return;
+            }
+            
+            if(!_relaxed)
+                _relaxed.reset(new AvlRelaxed());
+            _relaxed->steps = stepsPerInsert;
+        }
+        
+        /**
+         *	Rebalances up to budget of the nodes queued in relaxed balance mode, and
+         *	returns true if the tree is fully balanced afterwards.
+         */
+        bool rebalance(unsigned long budget = ULONG_MAX)
+        {
+            if(!_relaxed)
+                return true;
+            
+            std::vector<Node *>& pending = _relaxed->pending;
+            for(; budget > 0 && _relaxed->head < pending.size(); budget--)
+                avlGrow(pending[_relaxed->head++]);
+            
+            /**
+             *	A queue that never quite empties would otherwise keep growing.
+             */
+            if(_relaxed->head < pending.size())
+            {
+                if(_relaxed->head * 2 >= pending.size())
+                {
+                    pending.erase(pending.begin(), pending.begin() + _relaxed->head);
+                    _relaxed->head = 0;
+                }
+                return false;
+            }
+            
+            pending.clear();
+            _relaxed->head = 0;
+            return true;
+        }
+        
+        /**
+         *	Returns true if no inserts are waiting to be rebalanced.
+         */
+        bool isBalanced() const { return !_relaxed || _relaxed->head == _relaxed->pending.size(); }
+        
+        /**
+         *	The orders in which relayout() can place the nodes in memory.
+         */
+        enum Layout
+        {
+            /**
+             *	Sorted by key, for in-order scans.
+             */
+            IN_ORDER,
+            /**
+             *	Level by level, so the top levels share a few cache lines.
+             */
+            BREADTH_FIRST,
+            /**
+             *	Recursively blocked subtrees, for lookups at every cache level.
+             */
+            VAN_EMDE_BOAS
+        };
+        
+        /**
+         *	Moves all the nodes into one contiguous block of memory, in the specified
+         *	order, to restore the locality that a long history of inserts and removes
+         *	destroys. The tree stays mutable: new nodes are allocated as usual, and
+         *	removed nodes are destroyed in place, their memory being reclaimed with
+         *	the block. Node pointers obtained before the relayout become invalid.
+         *
+         *	Every node is moved into its new place and its old copy is left pointing
+         *	to it, so all the parent and child pointers are fixed in a single pass.
+         */
+        void relayout(Layout layout)
+        {
+            rebalance();
+            avlHotClear();
+            
+            if(_root == NULL)
+                return;
+            
+            std::vector<Node *> order;
+            order.reserve(_size);
+            
+            if(layout == IN_ORDER)
+            {
+                for(Node * it = _leftmost; it; it = it->getNext())
+                    order.push_back(it);
+            }
+            else if(layout == BREADTH_FIRST)
+            {
+                order.push_back(_root);
+                for(size_t i = 0; i < order.size(); i++)
+                    for(unsigned int c = 0; c < 2; c++)
+                        if(order[i]->child[c])
+                            order.push_back(order[i]->child[c]);
+            }
+            else
+            {
+                avlVanEmdeBoas(_root, avlSpineHeight(_root), order);
+            }
+            
+            AvlSlab slab;
+            slab.memory = std::shared_ptr<void>(::operator new(order.size() * sizeof(Node)), avlFreeSlab);
+            slab.begin = static_cast<Node *>(slab.memory.get());
+            slab.end = slab.begin + order.size();
+            
+            for(size_t i = 0; i < order.size(); i++)
+            {
+                new(slab.begin + i) Node(std::move(*order[i]));
+                order[i]->parent = slab.begin + i;
+            }
+            
+            /**
+             *	The parent pointer of every old node now points to its new copy.
+             */
+            for(Node * it = slab.begin; it != slab.end; it++)
+            {
+                for(unsigned int c = 0; c < 2; c++)
+                    if(it->child[c])
+                        it->child[c] = it->child[c]->parent;
+                
+                if(it->parent)
+                    it->parent = it->parent->parent;
+            }
+            
+            _root = _root->parent;
+            _leftmost = _leftmost->parent;
+            _rightmost = _rightmost->parent;
+            
+            for(size_t i = 0; i < order.size(); i++)
+                avlDelete(order[i]);
+            
+            _slabs.clear();
+            _slabs.push_back(slab);
+        }
+        
+        /**
+         *	Relays the tree out for lookups.
+         */
+        void compact() { relayout(VAN_EMDE_BOAS); }
+        
+        /**
+         *	Puts a hash cache with room for (about) the specified number of nodes in
+         *	front of find(), so lookups of hot keys skip the walk down the tree. The
+         *	cache has 4 nodes per cache-line-sized bucket. A count-min sketch of the
+         *	recent lookups decides which keys get in, so the long tail of cold keys
+         *	does not flush the hot ones.
+         *
+         *	Rotations keep node identity, so the cache only drops nodes that are
+         *	removed, and it empties itself before bulk operations. With the cache,
+         *	concurrent find() calls are no longer safe, since every lookup updates
+         *	the sketch. Hash is only needed by trees that enable the cache.
+         */
+        template<class Hash = std::hash<Key> >
+        void enableHotCache(unsigned long slots)
+        {
+            size_t buckets = 1;
+            while(buckets * HOT_WAYS < slots)
+                buckets *= 2;
+            
+            _hot.reset(new AvlHotCache());
+            
+            /**
+             *	Allocate an extra cache line to align the buckets to cache lines.
+             */
+            _hot->memory.reset(new char[buckets * sizeof(AvlHotBucket) + HOT_LINE]);
+            uintptr_t memory = reinterpret_cast<uintptr_t>(_hot->memory.get());
+            _hot->buckets = reinterpret_cast<AvlHotBucket *>((memory + HOT_LINE - 1) & ~static_cast<uintptr_t>(HOT_LINE - 1));
+            _hot->mask = buckets - 1;
+            _hot->hash = &avlHotHash<Hash>;
+            avlHotClear();
+            
+            _hot->sketchMask = buckets * HOT_WAYS * 4 - 1;
+            _hot->sketch.reset(new uint8_t[HOT_ROWS * (_hot->sketchMask + 1)]());
+        }
+        
+        void disableHotCache() { _hot.reset(); }
+        
+        /**
+         *	Return the number of find() calls answered by the hot cache and by the tree.
+         */
+        unsigned long hotCacheHits() const { return _hot ? _hot->hits : 0; }
+        unsigned long hotCacheMisses() const { return _hot ? _hot->misses : 0; }
+        
+        /**
+         *	Returns the number of (key, value) pairs stored into the tree.
+         */
+        unsigned long size() const { return _size; }
+        
+        unsigned int height() const
+        {
+            return avlHeight(_root);
+        }
+
+        Node * getRoot() { return _root; }
+        const Node * getRoot() const { return _root; }
+        
+        /**
+         *	Return the nodes with the smallest and the largest keys, or null if the
+         *	tree is empty.
+         */
+        Node * getLeftmost() { return _leftmost; }
+        const Node * getLeftmost() const { return _leftmost; }
+        Node * getRightmost() { return _rightmost; }
+        const Node * getRightmost() const { return _rightmost; }
+
+    protected:
+        /**
+         *	The comparator object takes in two keys as parameters and returns
+         *	true if the first one is less than the second one and false otherwise.
+         */
+        Compare _compare;
+        
+        /**
+         *	Pointer to the root of the tree.
+         */
+        Node * _root;
+        
+        /**
+         *	The size of the tree -- the number of nodes.
+         */
+        unsigned long _size;
+        
+        /**
+         *	The nodes with the smallest and the largest keys, kept up to date so
+         *	that (nearly) sorted keys can be inserted without descending the tree.
+         */
+        Node * _leftmost, * _rightmost;
+        
+        /**
+         *	Relaxed balance mode, if on: how many queued nodes to rebalance after
+         *	every insert, and the queue of inserted nodes that have not been
+         *	rebalanced yet, starting at head. Only allocated while the mode is on,
+         *	so it costs other trees a single pointer.
+         */
+        enum { RELAXED_MAX_PENDING = 1 << 12 };
+        struct AvlRelaxed
+        {
+            AvlRelaxed() : steps(0), head(0) {}
+            
+            unsigned int steps;
+            std::vector<Node *> pending;
+            size_t head;
+        };
+        std::unique_ptr<AvlRelaxed> _relaxed;
+        
+        /**
+         *	The blocks that relayout() moved nodes into. Extracted ranges share the
+         *	blocks of their nodes, so a block is freed with the last tree using it.
+         */
+        struct AvlSlab
+        {
+            std::shared_ptr<void> memory;
+            Node * begin, * end;
+        };
+        std::vector<AvlSlab> _slabs;
+        
+        /**
+         *	The hot cache, only allocated once enabled: 2^k buckets of HOT_WAYS
+         *	(node, hash) pairs, aligned inside memory, and HOT_ROWS rows of 8-bit
+         *	sketch counters.
+         */
+        enum { HOT_WAYS = 4, HOT_ROWS = 4, HOT_LINE = 64 };
+        struct AvlHotBucket
+        {
+            AvlHotBucket() : node(), hash() {}
+            
+            Node * node[HOT_WAYS];
+            uint64_t hash[HOT_WAYS];
+        };
+        struct AvlHotCache
+        {
+            AvlHotCache() : buckets(NULL), mask(0), hash(NULL), sketchMask(0), samples(0), hits(0), misses(0) {}
+            
+            std::unique_ptr<char[]> memory;
+            AvlHotBucket * buckets;
+            size_t mask;
+            size_t (*hash)(const Key&);
+            std::unique_ptr<uint8_t[]> sketch;
+            size_t sketchMask;
+            unsigned long samples, hits, misses;
+        };
+        std::unique_ptr<AvlHotCache> _hot;
 };
@@ -4,12 +4,25 @@
  */
 #include <AvlTests.hpp>
 
+#include <algorithm>
+#include <chrono>
+#include <cstring>
 #include <ctime>
+#include <fstream>
+#include <iterator>
+#include <map>
+#include <queue>
+#include <set>
 #include <vector>
 #include <iomanip>
 #include <stdexcept>
 #include <memory>
 
+#include <dirent.h>
+#include <malloc.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
 using std::endl;
 using std::setw;
 
@@ -64,6 +77,17 @@ void AvlTests::testHeight() {
 
 }
 
+// Orders keys ascending or descending, depending on how it was constructed
+class AvlOrder
+{
+    public:
+        explicit AvlOrder(bool descending = false) : _descending(descending) {}
+        bool operator()(long a, long b) const { return _descending ? b < a : a < b; }
+
+    private:
+        bool _descending;
+};
+
 void AvlTests::testComparator() {
     Tree tree;
 
@@ -88,24 +112,1345 @@ void AvlTests::testComparator() {
         if(tree.greaterThan(n1.get(), n1.get()))
             throw new std::runtime_error("greaterThan is not working: equal item reported greater");
     }
+
+    // A comparator with state is passed on to the ranges extracted from the tree
+    AvlTree<long, long, AvlOrder> descending(AvlOrder(true));
+    for(long i = 0; i < 1024; i++)
+        descending.insert(i, i);
+
+    AvlTree<long, long, AvlOrder> range = descending.extractRange(767, 256);
+    for(long i = 1024; i < 1280; i++)
+        range.insert(i % 2 ? 1024 - i / 2 : i / 4, i);
+
+    long last = 1L << 20;
+    for(AvlTree<long, long, AvlOrder>::Node * it = range.min(); it; it = it->getNext())
+    {
+        if(it->entry.key > last)
+            throw new std::runtime_error("extractRange(lo, hi) did not keep the comparator of the tree");
+        last = it->entry.key;
+    }
+}
+
+void AvlTests::testRemoves()
+{
+    checkRemoves<Tree>();
+    checkRemoves<SizeTree>();
+
+    // TTL sweep: expire a window of timestamps at a time
+    const unsigned long window = 64;
+    Tree perKey, ranged;
+
+    for(unsigned long i = 0; i < _testSize; i++) {
+        perKey.insert(i, i);
+        ranged.insert(i, i);
+    }
+
+    clock_t begin = clock();
+    for(unsigned long i = 0; i < _testSize; i++)
+        perKey.remove(i);
+    double perKeyTime = (double)(clock() - begin) / CLOCKS_PER_SEC;
+
+    begin = clock();
+    for(unsigned long i = 0; i < _testSize; i += window)
+        ranged.eraseRange(i, i + window - 1);
+    double rangedTime = (double)(clock() - begin) / CLOCKS_PER_SEC;
+
+    if(perKey.size() != 0 || ranged.size() != 0 || ranged.getRoot() != NULL)
+        throw new std::runtime_error("Tree is not empty after expiring all the keys");
+
+    loginfo << "Expired " << _testSize << " keys in windows of " << window << ": " << perKeyTime
+        << " seconds with remove(key), " << rangedTime << " seconds with eraseRange(lo, hi)" << endl;
+}
+
+template<class T>
+void AvlTests::checkRemoves()
+{
+    T tree;
+    std::multiset<long> expected;
+
+    // Small key range, so there are duplicates to remove too
+    long range = _testSize / 4 + 1;
+    loginfo << "Inserting and removing " << _testSize << " random numbers ranging from 0 to " << range - 1 << "..." << endl;
+
+    for(unsigned long i = 0; i < _testSize; i++) {
+        long num = rand() % range;
+        tree.insert(num, num);
+        expected.insert(num);
+    }
+
+    for(unsigned long i = 0; i < _testSize / 2; i++)
+    {
+        long num = rand() % range;
+
+        if(expected.count(num) == 0) {
+            try {
+                tree.remove(num);
+            } catch(std::exception * e) {
+                delete e;
+                continue;
+            }
+            throw new std::runtime_error("Removing a missing key should throw");
+        }
+
+        if(tree.remove(num) != num)
+            throw new std::runtime_error("remove(key) returned the wrong value");
+        expected.erase(expected.find(num));
+
+        if(_checkIntegrity && !testIntegrity(tree))
+            throw new std::runtime_error("Integrity check failed while removing random numbers.");
+    }
+
+    if(!testIntegrity(tree) || !sameKeys(tree, expected.begin(), expected.end()))
+        throw new std::runtime_error("Tree does not match the expected keys after removals");
+
+    // Take out random ranges until the tree is empty, alternating erasing and extracting
+    for(int i = 0; !expected.empty(); i++)
+    {
+        long lo = rand() % range;
+        long hi = lo + rand() % (i % 4 ? 16 : range / 4 + 1);
+        std::multiset<long>::iterator first = expected.lower_bound(lo), last = expected.upper_bound(hi);
+        unsigned long count = std::distance(first, last);
+
+        if(i % 2) {
+            if(tree.eraseRange(lo, hi) != count)
+                throw new std::runtime_error("eraseRange(lo, hi) erased the wrong number of keys");
+        } else {
+            T extracted = tree.extractRange(lo, hi);
+            if(extracted.size() != count || !testIntegrity(extracted) || !sameKeys(extracted, first, last))
+                throw new std::runtime_error("extractRange(lo, hi) returned the wrong keys");
+        }
+
+        expected.erase(first, last);
+
+        if(tree.size() != expected.size() || !testIntegrity(tree))
+            throw new std::runtime_error("Integrity check failed while removing ranges.");
+    }
+}
+
+template<class T, class It>
+bool AvlTests::sameKeys(const T& tree, It first, It last) const
+{
+    decltype(tree.getRoot()) it = tree.getRoot();
+
+    while(it && it->getLeft())
+        it = it->getLeft();
+
+    for(; it && first != last; ++first, it = it->getNext())
+        if(it->entry.key != *first)
+            return false;
+
+    return it == NULL && first == last;
+}
+
+void AvlTests::testDuplicates()
+{
+    SizeTree stable;
+    AvlMultiTree<long, long> counted;
+    std::multimap<long, long> expected;
+
+    // Skewed input: 7 out of 8 inserts hit one of 8 hot keys
+    const long numKeys = 1024;
+    loginfo << "Inserting " << _testSize << " skewed keys ranging from 0 to " << numKeys - 1 << "..." << endl;
+
+    for(unsigned long i = 0; i < _testSize; i++)
+    {
+        long key = (rand() % 8 == 0) ? rand() % numKeys : rand() % 8;
+
+        stable.insert(key, i);
+        counted.insert(key, i);
+        expected.insert(std::make_pair(key, static_cast<long>(i)));
+
+        if(_checkIntegrity && !testIntegrity(stable))
+            throw new std::runtime_error("Integrity check failed while inserting duplicate keys.");
+    }
+
+    if(stable.size() != _testSize || counted.size() != _testSize)
+        throw new std::runtime_error("Tree size does not match expected size after inserting duplicates");
+
+    for(long key = 0; key < numKeys; key++)
+    {
+        unsigned long count = expected.count(key);
+        if(stable.count(key) != count || counted.count(key) != count)
+            throw new std::runtime_error("count(key) does not match the number of inserted duplicates");
+
+        // Both trees must return the values of a key in insertion order
+        std::pair<std::multimap<long, long>::iterator, std::multimap<long, long>::iterator> range = expected.equal_range(key);
+        std::pair<SizeNode *, SizeNode *> nodes = stable.equalRange(key);
+        std::pair<long *, long *> values = counted.equalRange(key);
+
+        for(std::multimap<long, long>::iterator it = range.first; it != range.second; ++it)
+        {
+            if(nodes.first == nodes.second || nodes.first->getValue() != it->second)
+                throw new std::runtime_error("equalRange(key) of AvlTree is not in insertion order");
+            if(values.first == values.second || *values.first != it->second)
+                throw new std::runtime_error("equalRange(key) of AvlMultiTree is not in insertion order");
+
+            nodes.first = nodes.first->getNext();
+            values.first++;
+        }
+
+        if(nodes.first != nodes.second || values.first != values.second)
+            throw new std::runtime_error("equalRange(key) returned too many values");
+    }
+
+    // Removing a key removes its oldest value, unless all of them are asked for
+    for(long key = 0; key < 8; key++)
+    {
+        std::multimap<long, long>::iterator oldest = expected.find(key);
+        if(oldest == expected.end())
+            continue;
+
+        long value = oldest->second;
+        expected.erase(oldest);
+        if(stable.remove(key) != value || counted.remove(key) != value || counted.count(key) != expected.count(key))
+            throw new std::runtime_error("remove(key) did not remove the oldest value");
+    }
+
+    unsigned long hot = expected.count(0);
+    if(counted.removeAll(0).size() != hot || counted.count(0) != 0 || counted.size() != stable.size() - hot)
+        throw new std::runtime_error("removeAll(key) did not remove all the values");
+    expected.erase(0);
+
+    // An extracted range counts its own values
+    unsigned long cold = std::distance(expected.lower_bound(8), expected.end());
+    AvlMultiTree<long, long> rare = counted.extractRange(8, numKeys);
+    if(rare.size() != cold || rare.count(8) != expected.count(8) || counted.size() != expected.size() - cold)
+        throw new std::runtime_error("extractRange(lo, hi) of AvlMultiTree did not count the values it moved");
+    expected.erase(expected.lower_bound(8), expected.end());
+
+    // Draining a hot key one value at a time, oldest first, takes linear time
+    // and keeps the remaining values in order
+    hot = counted.count(1);
+    for(unsigned long i = 0; i < hot; i++)
+    {
+        std::multimap<long, long>::iterator oldest = expected.find(1);
+        std::pair<long *, long *> values = counted.equalRange(1);
+
+        if(values.first == values.second || *values.first != oldest->second || counted.remove(1) != oldest->second)
+            throw new std::runtime_error("remove(key) did not drain the values in insertion order");
+
+        expected.erase(oldest);
+    }
+
+    if(counted.count(1) != 0 || counted.size() != expected.size())
+        throw new std::runtime_error("Draining a key did not remove all of its values");
+
+    loginfo << "One node per duplicate: " << stable.size() << " nodes, height " << stable.height() << endl;
+    loginfo << "Counted duplicates:     " << counted.nodes() << " nodes, height " << counted.height() << endl;
+}
+
+void AvlTests::testHintedInserts()
+{
+    // Timestamps arriving in order, and arriving a little out of order
+    std::vector<long> sequential, nearlySorted;
+    unsigned long count = _testSize * 64;
+
+    for(unsigned long i = 0; i < count; i++) {
+        sequential.push_back(i);
+        nearlySorted.push_back(i * 4 + rand() % 16);
+    }
+
+    checkHintedInserts("sequential", sequential);
+    checkHintedInserts("nearly sorted", nearlySorted);
+}
+
+void AvlTests::checkHintedInserts(const char * name, const std::vector<long>& keys)
+{
+    Tree plain, hinted;
+
+    clock_t begin = clock();
+    for(size_t i = 0; i < keys.size(); i++)
+        plain.insert(keys[i], keys[i]);
+    double plainTime = (double)(clock() - begin) / CLOCKS_PER_SEC;
+
+    begin = clock();
+    Node * hint = NULL;
+    for(size_t i = 0; i < keys.size(); i++)
+        hint = hinted.insert(hint, keys[i], keys[i]);
+    double hintedTime = (double)(clock() - begin) / CLOCKS_PER_SEC;
+
+    std::vector<long> sorted(keys);
+    std::sort(sorted.begin(), sorted.end());
+
+    if(!testIntegrity(hinted) || !sameKeys(hinted, sorted.begin(), sorted.end()))
+        throw new std::runtime_error("Integrity check failed after hinted inserts.");
+
+    loginfo << "Inserted " << keys.size() << " " << name << " keys: " << plainTime
+        << " seconds without hints, " << hintedTime << " seconds with hints" << endl;
+}
+
+void AvlTests::testDurability()
+{
+    char dir[] = "/tmp/avltest.XXXXXX";
+    if(mkdtemp(dir) == NULL)
+        throw new std::runtime_error("Could not create a temporary directory");
+
+    // Random inserts and removes over a small key range, so there are duplicates
+    std::vector<std::pair<bool, long> > ops;
+    std::multiset<long> present;
+    long range = _testSize / 8 + 1;
+
+    for(unsigned long i = 0; i < _testSize * 2 + 5; i++) {
+        long key = rand() % range;
+        bool insert = present.count(key) == 0 || rand() % 3 != 0;
+
+        ops.push_back(std::make_pair(insert, key));
+        if(insert)
+            present.insert(key);
+        else
+            present.erase(present.find(key));
+    }
+
+    // Checkpoints commit the log too, so keep them on group boundaries. Then
+    // everything but the last, partial group is committed when the child crashes.
+    const unsigned int groupSize = 16;
+    const unsigned long checkpointInterval = 256;
+    unsigned long committed = ops.size() / groupSize * groupSize;
+
+    loginfo << "Crashing after " << ops.size() << " logged operations in " << dir << "..." << endl;
+
+    pid_t pid = fork();
+    if(pid == 0) {
+        int rc = 0;
+        try {
+            DurableTree * tree = new DurableTree(dir, groupSize, checkpointInterval);
+            applyOps(*tree, ops, ops.size());
+        } catch(std::exception * e) {
+            logerror << "Exception caught: " << e->what() << endl;
+            rc = 1;
+        }
+        // Crash: no destructors, so the last group is never committed
+        _exit(rc);
+    }
+
+    int status;
+    if(pid == -1 || waitpid(pid, &status, 0) != pid || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+        throw new std::runtime_error("The crashing child process failed");
+
+    {
+        DurableTree tree(dir, groupSize, checkpointInterval);
+        checkRecovered(tree, ops, committed);
+    }
+
+    // A torn record at the end of the log must be ignored
+    DIR * files = opendir(dir);
+    while(struct dirent * entry = readdir(files)) {
+        if(strncmp(entry->d_name, "wal-", 4) == 0) {
+            std::ofstream wal((std::string(dir) + "/" + entry->d_name).c_str(), std::ios::app | std::ios::binary);
+            wal << "torn";
+        }
+    }
+    closedir(files);
+
+    {
+        DurableTree tree(dir, groupSize, checkpointInterval);
+        checkRecovered(tree, ops, committed);
+    }
+
+    removeDir(dir);
+
+    // A corrupted checkpoint falls back to the previous one, when a crash left it behind
+    if(mkdtemp(strcpy(dir, "/tmp/avltest.XXXXXX")) == NULL)
+        throw new std::runtime_error("Could not create a temporary directory");
+
+    std::string base(dir);
+    {
+        DurableTree tree(dir);
+        for(long i = 0; i < 8; i++) {
+            if(i == 5)
+                tree.checkpoint();
+            tree.insert(i, i);
+        }
+        tree.commit();
+
+        std::ofstream(base + "/saved-checkpoint", std::ios::binary) << std::ifstream(base + "/checkpoint-1", std::ios::binary).rdbuf();
+        std::ofstream(base + "/saved-wal", std::ios::binary) << std::ifstream(base + "/wal-1", std::ios::binary).rdbuf();
+
+        // These operations are lost along with the checkpoint they follow
+        tree.checkpoint();
+        for(long i = 8; i < 12; i++)
+            tree.insert(i, i);
+    }
+
+    rename((base + "/saved-checkpoint").c_str(), (base + "/checkpoint-1").c_str());
+    rename((base + "/saved-wal").c_str(), (base + "/wal-1").c_str());
+    if(truncate((base + "/checkpoint-2").c_str(), 10) != 0)
+        throw new std::runtime_error("Could not corrupt the checkpoint");
+
+    {
+        DurableTree tree(dir);
+        if(tree.size() != 8)
+            throw new std::runtime_error("Recovery did not fall back to the previous checkpoint");
+
+        tree.insert(100, 100);
+        tree.insert(101, 101);
+        tree.checkpoint();
+    }
+
+    {
+        DurableTree tree(dir);
+        if(tree.size() != 10 || tree.find(8) != NULL)
+            throw new std::runtime_error("A new checkpoint picked up the log of a corrupted one");
+    }
+
+    // Without any readable checkpoint, recovering an empty tree would lose everything
+    if(truncate((base + "/checkpoint-3").c_str(), 10) != 0)
+        throw new std::runtime_error("Could not corrupt the checkpoint");
+
+    bool opened = true;
+    try {
+        DurableTree tree(dir);
+    } catch(std::exception * e) {
+        delete e;
+        opened = false;
+    }
+
+    if(opened)
+        throw new std::runtime_error("A tree with no readable checkpoint was opened");
+
+    removeDir(dir);
+
+    // Throughput of logged inserts for various group commit sizes
+    unsigned long count = _testSize;
+    unsigned int groupSizes[] = { 1, 16, 256 };
+
+    std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+    {
+        Tree tree;
+        for(unsigned long i = 0; i < count; i++)
+            tree.insert(rand(), i);
+    }
+    double baseline = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+    loginfo << "Inserted " << count << " keys without logging in " << baseline << " seconds" << endl;
+
+    for(size_t g = 0; g < sizeof(groupSizes) / sizeof(groupSizes[0]); g++) {
+        char benchDir[] = "/tmp/avltest.XXXXXX";
+        if(mkdtemp(benchDir) == NULL)
+            throw new std::runtime_error("Could not create a temporary directory");
+
+        begin = std::chrono::steady_clock::now();
+        {
+            DurableTree tree(benchDir, groupSizes[g]);
+            for(unsigned long i = 0; i < count; i++)
+                tree.insert(rand(), i);
+        }
+        double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+
+        loginfo << "Inserted " << count << " keys with groups of " << setw(3) << groupSizes[g] << " in " << elapsed
+            << " seconds (" << static_cast<long>(count / elapsed) << " inserts/s)" << endl;
+
+        removeDir(benchDir);
+    }
+}
+
+void AvlTests::applyOps(DurableTree& tree, const std::vector<std::pair<bool, long> >& ops, unsigned long count) const
+{
+    for(unsigned long i = 0; i < count; i++) {
+        if(ops[i].first)
+            tree.insert(ops[i].second, i);
+        else
+            tree.remove(ops[i].second);
+    }
+}
+
+void AvlTests::checkRecovered(DurableTree& tree, const std::vector<std::pair<bool, long> >& ops, unsigned long count) const
+{
+    // Removes take out the oldest value of a key, and multimap keeps values in insertion order
+    std::multimap<long, long> expected;
+    for(unsigned long i = 0; i < count; i++) {
+        if(ops[i].first)
+            expected.insert(std::make_pair(ops[i].second, static_cast<long>(i)));
+        else
+            expected.erase(expected.lower_bound(ops[i].second));
+    }
+
+    if(tree.size() != expected.size() || !testIntegrity(tree.tree()))
+        throw new std::runtime_error("Recovered tree is not consistent");
+
+    const Node * it = tree.tree().getLeftmost();
+    for(std::multimap<long, long>::iterator e = expected.begin(); e != expected.end(); ++e, it = it->getNext())
+        if(it->entry.key != e->first || it->entry.value != e->second)
+            throw new std::runtime_error("Recovered tree does not match the committed operations");
+}
+
+void AvlTests::removeDir(const char * dir) const
+{
+    DIR * files = opendir(dir);
+    if(files == NULL)
+        return;
+
+    while(struct dirent * entry = readdir(files))
+        if(entry->d_name[0] != '.')
+            unlink((std::string(dir) + "/" + entry->d_name).c_str());
+
+    closedir(files);
+    rmdir(dir);
+}
+
+void AvlTests::testRelaxedBalance()
+{
+    // Rebalance a little at a time in between bursts, and make sure we always get back to an AVL tree
+    Tree tree;
+    std::multiset<long> expected;
+    tree.setRelaxedBalance(true, 1);
+
+    for(unsigned long burst = 0; burst < 16; burst++) {
+        for(unsigned long i = 0; i < _testSize / 8; i++) {
+            long num = (burst % 2) ? burst * _testSize + i : rand() % _range;
+            tree.insert(num, num);
+            expected.insert(num);
+        }
+
+        while(!tree.rebalance(_testSize / 64))
+            ;
+
+        if(!testIntegrity(tree) || !sameKeys(tree, expected.begin(), expected.end()))
+            throw new std::runtime_error("Integrity check failed after relaxed inserts.");
+
+        // Removes balance the tree before removing
+        tree.insert(-1, -1);
+        tree.remove(-1);
+        if(!tree.isBalanced() || !testIntegrity(tree))
+            throw new std::runtime_error("Integrity check failed after removing in relaxed balance mode.");
+    }
+
+    // Sorted keys, like timestamps, must not turn the tree into a list while inserts are queued
+    Tree sorted;
+    sorted.setRelaxedBalance(true);
+    for(unsigned long i = 0; i < _testSize * 16; i++)
+        sorted.insert(i, i);
+
+    if(sorted.height() > 1.5 * std::log2(sorted.size() + 2.0) + 3)
+        throw new std::runtime_error("Sorted inserts made a relaxed tree too deep.");
+
+    sorted.rebalance();
+    if(!testIntegrity(sorted) || sorted.size() != _testSize * 16)
+        throw new std::runtime_error("Integrity check failed after sorted relaxed inserts.");
+
+    // Burst insert latency, eager vs. relaxed with the rebalancing done afterwards
+    unsigned long count = _testSize * 64;
+    std::vector<long> keys;
+    for(unsigned long i = 0; i < count; i++)
+        keys.push_back(rand() % _range);
+
+    for(int relaxed = 0; relaxed < 2; relaxed++) {
+        Tree burst;
+        burst.setRelaxedBalance(relaxed != 0);
+        std::vector<double> latencies(count);
+
+        for(unsigned long i = 0; i < count; i++) {
+            std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+            burst.insert(keys[i], i);
+            latencies[i] = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - begin).count();
+        }
+
+        std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+        burst.rebalance();
+        double rebalanceTime = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+
+        if(!testIntegrity(burst))
+            throw new std::runtime_error("Integrity check failed after a burst of inserts.");
+
+        std::sort(latencies.begin(), latencies.end());
+        loginfo << (relaxed ? "Relaxed" : "Eager  ") << " burst of " << count << " inserts: p50 " << latencies[count / 2]
+            << " us, p99 " << latencies[count * 99 / 100] << " us, max " << latencies[count - 1]
+            << " us, rebalancing afterwards took " << rebalanceTime << " seconds" << endl;
+    }
+}
+
+void AvlTests::testRelayout()
+{
+    // Age a tree with inserts and removes, so that neighbouring nodes end up far apart in memory
+    unsigned long count = _testSize * 64;
+    Tree tree;
+    std::multiset<long> expected;
+    std::vector<long> keys;
+
+    for(unsigned long i = 0; i < count * 2; i++) {
+        long num = rand() % _range;
+        tree.insert(num, num);
+        expected.insert(num);
+        keys.push_back(num);
+    }
+    std::random_shuffle(keys.begin(), keys.end());
+    for(unsigned long i = 0; i < count; i++) {
+        tree.remove(keys[i]);
+        expected.erase(expected.find(keys[i]));
+    }
+    keys.erase(keys.begin(), keys.begin() + count);
+    std::random_shuffle(keys.begin(), keys.end());
+
+    const char * names[] = { "aged", "in-order", "breadth-first", "van Emde Boas" };
+    for(int layout = -1; layout <= Tree::VAN_EMDE_BOAS; layout++) {
+        if(layout >= 0)
+            tree.relayout(static_cast<Tree::Layout>(layout));
+
+        if(!testIntegrity(tree) || !sameKeys(tree, expected.begin(), expected.end()))
+            throw new std::runtime_error("Integrity check failed after relayout.");
+
+        std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+        long sum = 0;
+        for(int round = 0; round < 4; round++)
+            for(size_t i = 0; i < keys.size(); i++)
+                sum += *tree.find(keys[i]);
+        double findTime = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+
+        begin = std::chrono::steady_clock::now();
+        for(int round = 0; round < 16; round++)
+            for(Node * it = tree.getLeftmost(); it; it = it->getNext())
+                sum -= it->getValue();
+        double scanTime = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+
+        loginfo << "Layout " << names[layout + 1] << ": " << keys.size() * 4 << " finds took " << findTime
+            << " seconds, 16 in-order scans took " << scanTime << " seconds (" << sum << ")" << endl;
+    }
+
+    // The compacted tree stays mutable, including the nodes that live in the slab
+    tree.compact();
+    for(unsigned long i = 0; i < _testSize; i++) {
+        long num = rand() % _range;
+        tree.insert(num, num);
+        expected.insert(num);
+
+        tree.remove(keys[i]);
+        expected.erase(expected.find(keys[i]));
+    }
+
+    if(!testIntegrity(tree) || !sameKeys(tree, expected.begin(), expected.end()))
+        throw new std::runtime_error("Integrity check failed after mutating a compacted tree.");
+
+    // Extracted ranges keep the slab alive after the tree is relaid out again and destroyed
+    Tree range;
+    {
+        Tree other(std::move(tree));
+        range = other.extractRange(_range / 4, _range / 2);
+        other.relayout(Tree::BREADTH_FIRST);
+        if(!testIntegrity(other))
+            throw new std::runtime_error("Integrity check failed after relaying out the rest of an extracted range.");
+    }
+
+    std::multiset<long> inRange(expected.lower_bound(_range / 4), expected.upper_bound(_range / 2));
+    if(!testIntegrity(range) || !sameKeys(range, inRange.begin(), inRange.end()))
+        throw new std::runtime_error("Integrity check failed on a range extracted from a compacted tree.");
+
+    while(range.size() > 0)
+        range.remove(range.getRoot()->getKey());
+}
+
+void AvlTests::testKeyPrefixes()
+{
+    // URL-like keys, long enough to live on the heap, with and without a scheme that every key shares
+    const char * tlds[] = { ".com", ".org", ".net", ".io" };
+    unsigned long count = _testSize * 32;
+    std::vector<std::string> hosts, schemes;
+
+    for(unsigned long i = 0; i < count; i++) {
+        std::string url;
+        for(int c = 6 + rand() % 8; c > 0; c--)
+            url += static_cast<char>('a' + rand() % 26);
+        url += tlds[rand() % 4];
+        url += "/articles/";
+        url += std::to_string(rand() % _range);
+
+        hosts.push_back(url);
+        schemes.push_back("https://www." + url);
+    }
+
+    double plainTime = checkStringKeys<StringTree>(hosts);
+    double prefixedTime = checkStringKeys<PrefixedTree>(hosts);
+    loginfo << "Inserted and looked up " << count << " URLs: " << plainTime << " seconds with string keys, "
+        << prefixedTime << " seconds with prefixed keys" << endl;
+
+    plainTime = checkStringKeys<StringTree>(schemes);
+    prefixedTime = checkStringKeys<PrefixedTree>(schemes);
+    loginfo << "Inserted and looked up " << count << " URLs with a shared scheme: " << plainTime
+        << " seconds with string keys, " << prefixedTime << " seconds with prefixed keys" << endl;
+
+    // Looking plain strings up without copying them into prefixed keys first
+    PrefixedTree urls;
+    for(size_t i = 0; i < hosts.size(); i++)
+        urls.insert(hosts[i], i);
+
+    std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+    for(size_t i = 0; i < hosts.size(); i++)
+        if(urls.find(hosts[i]) == NULL)
+            throw new std::runtime_error("Could not find an inserted string key.");
+    double convertedTime = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+
+    begin = std::chrono::steady_clock::now();
+    for(size_t i = 0; i < hosts.size(); i++)
+        if(avlFindPrefixed(urls, hosts[i]) == NULL)
+            throw new std::runtime_error("avlFindPrefixed could not find an inserted string key.");
+    double uncopiedTime = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+
+    for(size_t i = 0; i < hosts.size(); i++)
+        if(avlFindPrefixed(urls, hosts[i]) != urls.find(hosts[i]))
+            throw new std::runtime_error("avlFindPrefixed did not find the same value as find");
+
+    if(avlFindPrefixed(urls, "no such url") != NULL)
+        throw new std::runtime_error("avlFindPrefixed found a key that was never inserted");
+
+    loginfo << "Looked up " << count << " URLs: " << convertedTime << " seconds converting them to prefixed keys, "
+        << uncopiedTime << " seconds with avlFindPrefixed" << endl;
+
+    // Short keys tie on their zero padding, and bytes above 0x7f order as unsigned
+    std::vector<std::string> sorted;
+    sorted.push_back("");
+    sorted.push_back("a");
+    sorted.push_back(std::string("a\0", 2));
+    sorted.push_back("ab");
+    sorted.push_back("abcdefgh");
+    sorted.push_back(std::string("abcdefgh\0", 9));
+    sorted.push_back("abcdefghi");
+    sorted.push_back("\x7f");
+    sorted.push_back("\x80");
+    sorted.push_back("\xff");
+
+    PrefixedTree tree;
+    for(size_t i = sorted.size(); i > 0; i--)
+        tree.insert(sorted[i - 1], i - 1);
+
+    if(!testIntegrity(tree) || !sameKeys(tree, sorted.begin(), sorted.end()) || *tree.find(std::string("a\0", 2)) != 2)
+        throw new std::runtime_error("Prefixed keys are not ordered like the strings they come from.");
+}
+
+template<class T>
+double AvlTests::checkStringKeys(const std::vector<std::string>& keys)
+{
+    T tree;
+    std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+
+    for(size_t i = 0; i < keys.size(); i++)
+        tree.insert(keys[i], i);
+
+    for(int round = 0; round < 4; round++)
+        for(size_t i = 0; i < keys.size(); i++)
+            if(tree.find(keys[i]) == NULL)
+                throw new std::runtime_error("Could not find an inserted string key.");
+
+    double time = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+
+    std::multiset<std::string> expected(keys.begin(), keys.end());
+    if(!testIntegrity(tree) || !sameKeys(tree, expected.begin(), expected.end()))
+        throw new std::runtime_error("Integrity check failed on string keys.");
+
+    return time;
 }
 
-void AvlTests::testRemoves() {
-    // TODO: build custom trees for all test cases
+void AvlTests::testParallel()
+{
+    unsigned long count = _testSize * 256;
+
+    checkParallel<Tree>("plain", count);
+    checkParallel<SizeTree>("size-augmented", count);
 }
 
-bool AvlTests::avlCheckBST(const Tree& tree, const Node * root, const Node * min, const Node * max, long& height, unsigned long& currTreeSize) const
+template<class T>
+void AvlTests::checkParallel(const char * name, unsigned long count)
+{
+    typedef typename T::Node N;
+
+    std::vector<AvlEntry<long, long> > entries;
+    for(unsigned long i = 0; i < count; i++)
+        entries.push_back(AvlEntry<long, long>(i * 3, i));
+
+    T tree;
+    tree.assignSorted(entries.begin(), entries.end());
+    long expected = static_cast<long>(count) * (count - 1) / 2;
+
+    // Single-threaded walk, for reference
+    std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+    long sum = 0;
+    for(N * it = tree.getLeftmost(); it; it = it->getNext())
+        sum += it->getValueRef();
+    double walkTime = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+
+    if(sum != expected)
+        throw new std::runtime_error("Sequential walk computed the wrong sum.");
+
+    loginfo << "Walked " << count << " " << name << " nodes on one thread in " << walkTime << " seconds" << endl;
+
+    unsigned int cores = std::thread::hardware_concurrency();
+    for(unsigned int threads = 1; threads <= std::max(cores, 4u); threads *= 2) {
+        AvlThreadPool pool(threads);
+
+        begin = std::chrono::steady_clock::now();
+        std::atomic<unsigned long> visited(0);
+        avlParallelForEach(pool, tree, [&visited](N *) { visited++; });
+        double forEachTime = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+
+        begin = std::chrono::steady_clock::now();
+        sum = avlParallelReduce(pool, tree, 0L, [](N * node) { return node->getValueRef(); },
+            [](long a, long b) { return a + b; });
+        double reduceTime = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+
+        // Every worker folds into its own slot, even when the results are bools
+        long last = (count - 1) * 3;
+        bool found = avlParallelReduce(pool, tree, false, [last](N * node) { return node->entry.key == last; },
+            [](bool a, bool b) { return a || b; });
+
+        std::vector<long> keys(count);
+        begin = std::chrono::steady_clock::now();
+        avlParallelExport(pool, tree, keys.begin(), [](N * node) { return node->entry.key; });
+        double exportTime = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+
+        if(visited != count || sum != expected || !found)
+            throw new std::runtime_error("Parallel traversal missed or repeated nodes.");
+
+        for(unsigned long i = 0; i < count; i++)
+            if(keys[i] != static_cast<long>(i * 3))
+                throw new std::runtime_error("Parallel export wrote the keys out of order.");
+
+        loginfo << threads << " thread(s) over " << count << " " << name << " nodes: for each " << forEachTime
+            << " seconds, reduce " << reduceTime << " seconds, export " << exportTime << " seconds" << endl;
+    }
+
+    // Exceptions thrown by the tasks come out of the call
+    AvlThreadPool pool(2);
+    try {
+        avlParallelForEach(pool, tree, [](N * node) {
+            if(node->entry.key == 3)
+                throw std::runtime_error("Visitor failed.");
+        });
+    } catch(std::runtime_error&) {
+        return;
+    }
+
+    throw new std::runtime_error("Exceptions thrown by parallel visitors are lost.");
+}
+
+void AvlTests::testPriorityQueue()
+{
+    // Pop from both ends and in batches, with duplicate keys, and compare to a multimap
+    SizeTree tree;
+    std::multimap<long, long> expected;
+    std::vector<SizeTree::Entry> batch;
+
+    for(unsigned long round = 0; round < 64; round++) {
+        for(unsigned long i = 0; i < _testSize / 4; i++) {
+            long num = rand() % (_testSize / 2);
+            tree.insert(num, round * _testSize + i);
+            expected.insert(std::make_pair(num, round * _testSize + i));
+        }
+
+        for(unsigned long i = 0; i < _testSize / 16; i++) {
+            SizeTree::Entry entry = tree.popMin();
+            if(entry.key != expected.begin()->first || entry.value != expected.begin()->second)
+                throw new std::runtime_error("popMin() did not return the oldest pair with the smallest key.");
+            expected.erase(expected.begin());
+
+            entry = tree.popMax();
+            if(entry.key != expected.rbegin()->first || entry.value != expected.rbegin()->second)
+                throw new std::runtime_error("popMax() did not return the newest pair with the largest key.");
+            expected.erase(--expected.end());
+        }
+
+        batch.clear();
+        unsigned long k = rand() % (_testSize / 8);
+        if(tree.popMinN(k, batch) != k || batch.size() != k)
+            throw new std::runtime_error("popMinN() did not pop as many pairs as asked.");
+        for(unsigned long i = 0; i < k; i++, expected.erase(expected.begin()))
+            if(batch[i].key != expected.begin()->first || batch[i].value != expected.begin()->second)
+                throw new std::runtime_error("popMinN() did not return the smallest pairs in order.");
+
+        if(tree.min()->entry.key != expected.begin()->first || tree.max()->entry.key != expected.rbegin()->first)
+            throw new std::runtime_error("min() or max() is out of date.");
+        if(!testIntegrity(tree) || tree.size() != expected.size())
+            throw new std::runtime_error("Integrity check failed after popping.");
+    }
+
+    batch.clear();
+    if(tree.popMinN(ULONG_MAX, batch) != expected.size() || tree.size() != 0 || tree.min() || tree.max() || !testIntegrity(tree))
+        throw new std::runtime_error("popMinN() did not empty the tree.");
+
+    // Counted duplicates pop one value at a time and keep their count of values right
+    AvlMultiTree<long, long> counted;
+    std::vector<AvlEntry<long, long> > sorted;
+    for(unsigned long i = 0; i < _testSize * 4; i++)
+        sorted.push_back(AvlEntry<long, long>(i / 8, i));
+
+    counted.assignSorted(sorted.begin(), sorted.end());
+    expected.clear();
+    for(unsigned long i = 0; i < sorted.size(); i++)
+        expected.insert(std::make_pair(sorted[i].key, sorted[i].value));
+
+    std::vector<AvlEntry<long, long> > values;
+    while(counted.size() > 0) {
+        AvlEntry<long, long> entry;
+        if(rand() % 3 == 0) {
+            entry = counted.popMax();
+            if(entry.key != expected.rbegin()->first || entry.value != expected.rbegin()->second)
+                throw new std::runtime_error("AvlMultiTree::popMax() did not return the newest value of the largest key.");
+            expected.erase(--expected.end());
+        } else if(rand() % 2 == 0) {
+            entry = counted.popMin();
+            if(entry.key != expected.begin()->first || entry.value != expected.begin()->second)
+                throw new std::runtime_error("AvlMultiTree::popMin() did not return the oldest value of the smallest key.");
+            expected.erase(expected.begin());
+        } else {
+            values.clear();
+            unsigned long k = std::min<unsigned long>(rand() % 20, expected.size());
+            if(counted.popMinN(k, values) != k)
+                throw new std::runtime_error("AvlMultiTree::popMinN() did not pop as many values as asked.");
+            for(unsigned long i = 0; i < k; i++, expected.erase(expected.begin()))
+                if(values[i].key != expected.begin()->first || values[i].value != expected.begin()->second)
+                    throw new std::runtime_error("AvlMultiTree::popMinN() did not return the smallest values in order.");
+        }
+
+        if(counted.size() != expected.size() || !testIntegrity(static_cast<const AvlTree<long, AvlMultiValues<long> >&>(counted)))
+            throw new std::runtime_error("AvlMultiTree lost count of its values while popping.");
+    }
+
+    // Timers: every expired timer is rearmed with a new deadline a random interval later
+    unsigned long timers = _testSize * 16, ticks = _testSize * 64;
+    std::vector<long> intervals;
+    for(unsigned long i = 0; i < ticks; i++)
+        intervals.push_back(1 + rand() % (_testSize * 64));
+
+    Tree queue;
+    std::priority_queue<std::pair<long, long>, std::vector<std::pair<long, long> >, std::greater<std::pair<long, long> > > heap;
+    std::multimap<long, long> map;
+    for(unsigned long i = 0; i < timers; i++) {
+        queue.insert(intervals[i], i);
+        heap.push(std::make_pair(intervals[i], i));
+        map.insert(std::make_pair(intervals[i], i));
+    }
+
+    std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+    unsigned long fired = 0, next = 0;
+    for(unsigned long now = 0; now < ticks; now++) {
+        while(queue.min()->entry.key <= static_cast<long>(now)) {
+            Tree::Entry timer = queue.popMin();
+            queue.insert(now + intervals[next++ % ticks], timer.value);
+            fired++;
+        }
+    }
+    double treeTime = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+
+    begin = std::chrono::steady_clock::now();
+    next = 0;
+    for(unsigned long now = 0; now < ticks; now++) {
+        while(heap.top().first <= static_cast<long>(now)) {
+            long timer = heap.top().second;
+            heap.pop();
+            heap.push(std::make_pair(now + intervals[next++ % ticks], timer));
+        }
+    }
+    double heapTime = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+
+    begin = std::chrono::steady_clock::now();
+    next = 0;
+    for(unsigned long now = 0; now < ticks; now++) {
+        while(map.begin()->first <= static_cast<long>(now)) {
+            long timer = map.begin()->second;
+            map.erase(map.begin());
+            map.insert(std::make_pair(now + intervals[next++ % ticks], timer));
+        }
+    }
+    double mapTime = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+
+    if(!testIntegrity(queue) || queue.size() != timers || next != fired)
+        throw new std::runtime_error("Integrity check failed after firing timers.");
+
+    loginfo << "Fired " << fired << " of " << timers << " timers: " << treeTime << " seconds with AvlTree, "
+        << heapTime << " seconds with std::priority_queue, " << mapTime << " seconds with std::multimap" << endl;
+
+    // Draining one at a time vs. in batches
+    std::vector<AvlEntry<long, long> > entries;
+    for(unsigned long i = 0; i < timers * 4; i++)
+        entries.push_back(AvlEntry<long, long>(i, i));
+
+    batch.clear();
+    queue.assignSorted(entries.begin(), entries.end());
+    begin = std::chrono::steady_clock::now();
+    while(queue.size() > 0)
+        batch.push_back(queue.popMin());
+    double singleTime = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+
+    batch.clear();
+    queue.assignSorted(entries.begin(), entries.end());
+    begin = std::chrono::steady_clock::now();
+    while(queue.popMinN(256, batch) > 0)
+        ;
+    double batchTime = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+
+    if(batch.size() != entries.size() || batch.back().key != entries.back().key)
+        throw new std::runtime_error("Batches did not drain the tree.");
+
+    loginfo << "Drained " << entries.size() << " timers in " << singleTime << " seconds one at a time, "
+        << batchTime << " seconds 256 at a time" << endl;
+}
+
+void AvlTests::testHotCache()
+{
+    // The cache must follow removes, pops, bulk operations and moves
+    Tree tree;
+    std::map<long, long> expected;
+    tree.enableHotCache(64);
+
+    for(unsigned long i = 0; i < _testSize * 4; i++) {
+        long num = rand() % _range;
+        if(expected.insert(std::make_pair(num, i)).second)
+            tree.insert(num, i);
+    }
+
+    for(unsigned long round = 0; round < 16; round++) {
+        checkHotCache(tree, expected);
+
+        // Remove some of the keys that are most likely cached, and put some of them back
+        std::map<long, long>::iterator it = expected.begin();
+        for(unsigned long i = 0; i < 16 && it != expected.end(); i++) {
+            long key = it->first;
+            tree.remove(key);
+            expected.erase(it++);
+
+            if(i % 2) {
+                tree.insert(key, -key);
+                expected[key] = -key;
+            }
+        }
+        checkHotCache(tree, expected);
+
+        Tree::Entry entry = round % 2 ? tree.popMax() : tree.popMin();
+        expected.erase(entry.key);
+        checkHotCache(tree, expected);
+
+        long lo = rand() % _range, hi = lo + _range / 64;
+        tree.eraseRange(lo, hi);
+        expected.erase(expected.lower_bound(lo), expected.upper_bound(hi));
+        checkHotCache(tree, expected);
+
+        tree.relayout(Tree::VAN_EMDE_BOAS);
+        checkHotCache(tree, expected);
+
+        Tree moved(std::move(tree));
+        tree = std::move(moved);
+    }
+
+    if(tree.hotCacheHits() == 0 || !testIntegrity(tree))
+        throw new std::runtime_error("The hot cache never answered a lookup.");
+
+    // Zipfian lookups, with and without the cache
+    unsigned long count = _testSize * 64, lookups = count * 4;
+    std::vector<AvlEntry<long, long> > entries;
+    for(unsigned long i = 0; i < count; i++)
+        entries.push_back(AvlEntry<long, long>(i * 7, i));
+
+    std::vector<long> ranked;
+    for(unsigned long i = 0; i < count; i++)
+        ranked.push_back(i * 7);
+    std::random_shuffle(ranked.begin(), ranked.end());
+
+    double skews[] = { 0.8, 1.0, 1.2 };
+    for(int s = 0; s < 3; s++) {
+        std::vector<double> cdf(count);
+        double total = 0;
+        for(unsigned long i = 0; i < count; i++)
+            cdf[i] = (total += 1.0 / std::pow(i + 1.0, skews[s]));
+
+        std::vector<long> keys;
+        for(unsigned long i = 0; i < lookups; i++) {
+            double u = total * rand() / (RAND_MAX + 1.0);
+            keys.push_back(ranked[std::upper_bound(cdf.begin(), cdf.end(), u) - cdf.begin()]);
+        }
+
+        double times[2];
+        Tree zipf;
+        zipf.assignSorted(entries.begin(), entries.end());
+        for(int cached = 0; cached < 2; cached++) {
+            if(cached)
+                zipf.enableHotCache(1024);
+
+            std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+            long sum = 0;
+            for(unsigned long i = 0; i < lookups; i++)
+                sum += *zipf.find(keys[i]);
+            times[cached] = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+
+            if(sum < 0)
+                throw new std::runtime_error("Zipfian lookups returned the wrong values.");
+        }
+
+        loginfo << lookups << " Zipfian lookups (s = " << skews[s] << ") over " << count << " keys: " << times[0]
+            << " seconds without the hot cache, " << times[1] << " seconds with it ("
+            << 100.0 * zipf.hotCacheHits() / lookups << "% hits)" << endl;
+    }
+}
+
+void AvlTests::checkHotCache(Tree& tree, const std::map<long, long>& expected) const
+{
+    const Tree& constTree = tree;
+
+    // Look the smallest keys up a few times, so they get cached, and then everything else
+    for(int round = 0; round < 4; round++) {
+        std::map<long, long>::const_iterator it = expected.begin();
+        for(unsigned long i = 0; i < 32 && it != expected.end(); i++, it++)
+            if(tree.find(it->first) == NULL || *constTree.find(it->first) != it->second)
+                throw new std::runtime_error("The hot cache returned the wrong value.");
+    }
+
+    for(std::map<long, long>::const_iterator it = expected.begin(); it != expected.end(); it++)
+        if(tree.find(it->first) == NULL || *tree.find(it->first) != it->second ||
+            (tree.find(it->first + 1) != NULL) != (expected.count(it->first + 1) != 0))
+            throw new std::runtime_error("The hot cache disagrees with the tree.");
+
+    if(tree.size() != expected.size())
+        throw new std::runtime_error("The tree lost track of its size.");
+}
+
+// The bytes of heap in use, including the large blocks malloc maps on its own
+static double heapInUse()
+{
+    struct mallinfo2 info = mallinfo2();
+    return info.uordblks + info.hblkhd;
+}
+
+void AvlTests::testSmallTrees()
+{
+    // Grow and shrink a small map across the inline threshold, checking it against a multimap
+    SmallTree small;
+    std::multimap<long, long> expected;
+
+    for(unsigned long i = 0; i < _testSize * 4; i++) {
+        long key = rand() % 32;
+        bool grow = (i / 64) % 2 == 0;
+
+        if(grow || expected.empty() || rand() % 4 == 0) {
+            small.insert(key, i);
+            expected.insert(std::make_pair(key, static_cast<long>(i)));
+        } else if(rand() % 8 == 0) {
+            long hi = key + rand() % 4;
+            small.eraseRange(key, hi);
+            expected.erase(expected.lower_bound(key), expected.upper_bound(hi));
+        } else if(expected.count(key)) {
+            if(small.remove(key) != expected.lower_bound(key)->second)
+                throw new std::runtime_error("AvlSmallTree::remove returned the wrong value");
+            expected.erase(expected.lower_bound(key));
+        }
+
+        if(small.size() != expected.size() || small.count(key) != expected.count(key))
+            throw new std::runtime_error("AvlSmallTree size does not match the expected size");
+
+        long * value = small.find(key);
+        if((value == NULL) != (expected.count(key) == 0) || (value && expected.count(key) == 1 && *value != expected.find(key)->second))
+            throw new std::runtime_error("AvlSmallTree::find returned the wrong value");
+        if(small.isInline() && small.size() > 8)
+            throw new std::runtime_error("AvlSmallTree did not move its pairs into a tree");
+    }
+
+    // Visiting, moving, extracting and popping work the same inline and in a tree
+    for(int grown = 0; grown < 2; grown++) {
+        SmallTree source;
+        std::multimap<long, long> pairs;
+        for(long i = 0; i < (grown ? 64 : 6); i++) {
+            source.insert(i % 16, i);
+            pairs.insert(std::make_pair(i % 16, i));
+        }
+
+        SmallTree moved;
+        moved.insert(-1, -1);
+        moved = std::move(source);
+
+        const SmallTree& constant = moved;
+        std::multimap<long, long>::iterator it = pairs.begin();
+        bool ordered = true;
+        constant.forEach([&](const long& key, const long& value) {
+            ordered = ordered && it != pairs.end() && it->first == key && it->second == value;
+            ++it;
+        });
+
+        if(!ordered || it != pairs.end() || source.size() != 0 || constant.find(-1) != NULL || *constant.find(3) != 3)
+            throw new std::runtime_error("AvlSmallTree::forEach did not visit the moved pairs in order");
+
+        SmallTree range = moved.extractRange(4, 11);
+        if(range.size() != static_cast<unsigned long>(std::distance(pairs.lower_bound(4), pairs.upper_bound(11))) ||
+            moved.size() + range.size() != pairs.size() || moved.count(4) != 0 || range.count(4) != pairs.count(4))
+            throw new std::runtime_error("AvlSmallTree::extractRange did not split the pairs at the range");
+        pairs.erase(pairs.lower_bound(4), pairs.upper_bound(11));
+
+        while(moved.size() > 0) {
+            bool max = moved.size() % 2 != 0;
+            std::multimap<long, long>::iterator popped = max ? --pairs.end() : pairs.begin();
+            SmallTree::Entry entry = max ? moved.popMax() : moved.popMin();
+
+            if(entry.key != popped->first || entry.value != popped->second)
+                throw new std::runtime_error("AvlSmallTree::popMin or popMax returned the wrong pair");
+            pairs.erase(popped);
+        }
+    }
+
+    // Lots of tiny maps, as kept per entity, with the heap they actually use measured
+    unsigned long maps = _testSize * 64;
+    std::vector<unsigned int> sizes(maps);
+    unsigned long pairs = 0;
+
+    for(unsigned long m = 0; m < maps; m++) {
+        sizes[m] = 1 + rand() % 8;
+        pairs += sizes[m];
+    }
+
+    double heap = heapInUse();
+    std::vector<Tree> trees(maps);
+    for(unsigned long m = 0; m < maps; m++)
+        for(unsigned int i = 0; i < sizes[m]; i++)
+            trees[m].insert(i * 3, i);
+    double treeBytes = heapInUse() - heap;
+
+    heap = heapInUse();
+    std::vector<SmallTree> smalls(maps);
+    for(unsigned long m = 0; m < maps; m++)
+        for(unsigned int i = 0; i < sizes[m]; i++)
+            smalls[m].insert(i * 3, i);
+    double smallBytes = heapInUse() - heap;
+
+    long sum = 0;
+    clock_t begin = clock();
+    for(unsigned long m = 0; m < maps; m++)
+        sum += *trees[(m * 7919) % maps].find(0);
+    double treeTime = (double)(clock() - begin) / CLOCKS_PER_SEC;
+
+    begin = clock();
+    for(unsigned long m = 0; m < maps; m++)
+        sum -= *smalls[(m * 7919) % maps].find(0);
+    double smallTime = (double)(clock() - begin) / CLOCKS_PER_SEC;
+
+    if(sum != 0)
+        throw new std::runtime_error("AvlSmallTree lookups do not match AvlTree lookups");
+
+    loginfo << "Stored " << pairs << " pairs in " << maps << " small maps: " << treeBytes / (1 << 20)
+        << " MiB of heap and " << treeTime << " seconds for " << maps << " lookups with AvlTree, "
+        << smallBytes / (1 << 20) << " MiB and " << smallTime << " seconds with AvlSmallTree" << endl;
+}
+
+// Collects the values of the intervals reported by an AvlIntervalTree query
+class IntervalCollector
+{
+    public:
+        IntervalCollector(std::vector<long>& values) : _values(values) {}
+        void operator()(IntervalTree::Node * node) { _values.push_back(node->getValue()); }
+
+    private:
+        std::vector<long>& _values;
+};
+
+void AvlTests::testIntervals()
+{
+    IntervalTree tree;
+    std::vector<AvlInterval<long> > intervals;
+    std::set<AvlInterval<long> > distinct;
+
+    // Mostly short intervals and a few long ones, like time or address ranges
+    unsigned long count = _testSize * 16;
+    long range = count * 16;
+
+    loginfo << "Inserting " << count << " random intervals within [0, " << range - 1 << "]..." << endl;
+
+    // The intervals are distinct, so removing one by key removes the one we expect
+    while(intervals.size() < count) {
+        long lo = rand() % range;
+        long length = (rand() % 100 == 0) ? rand() % (range / 8) : rand() % 64;
+        if(!distinct.insert(AvlInterval<long>(lo, lo + length)).second)
+            continue;
+
+        tree.insert(AvlInterval<long>(lo, lo + length), intervals.size());
+        intervals.push_back(AvlInterval<long>(lo, lo + length));
+    }
+
+    if(!testIntegrity(tree))
+        throw new std::runtime_error("Integrity check failed after inserting intervals.");
+
+    // Remove some intervals, so the maximum endpoints get fixed up by removals too
+    for(unsigned long i = 0; i < count; i += 4) {
+        tree.remove(intervals[i]);
+        intervals[i] = AvlInterval<long>(1, 0);
+    }
+    // Long intervals end past range, so compare them to the bounds the way the tree does
+    AvlInterval<long> first(range / 2, 0), last(range / 2 + range / 64, range);
+    tree.eraseRange(first, last);
+    for(unsigned long i = 0; i < count; i++)
+        if(!(intervals[i] < first) && !(last < intervals[i]))
+            intervals[i] = AvlInterval<long>(1, 0);
+
+    if(!testIntegrity(tree))
+        throw new std::runtime_error("Integrity check failed after removing intervals.");
+
+    const unsigned long queries = 256;
+    std::vector<std::pair<long, long> > windows;
+    for(unsigned long q = 0; q < queries; q++) {
+        long lo = rand() % range;
+        windows.push_back(std::make_pair(lo, (q % 2) ? lo : lo + rand() % 256));
+    }
+
+    std::vector<long> found, expected;
+    clock_t begin = clock();
+    for(unsigned long q = 0; q < queries; q++) {
+        if(windows[q].first == windows[q].second)
+            tree.stab(windows[q].first, IntervalCollector(found));
+        else
+            tree.overlapping(windows[q].first, windows[q].second, IntervalCollector(found));
+    }
+    double treeTime = (double)(clock() - begin) / CLOCKS_PER_SEC;
+
+    begin = clock();
+    for(unsigned long q = 0; q < queries; q++)
+        for(unsigned long i = 0; i < count; i++)
+            if(intervals[i].overlaps(windows[q].first, windows[q].second))
+                expected.push_back(i);
+    double scanTime = (double)(clock() - begin) / CLOCKS_PER_SEC;
+
+    std::sort(found.begin(), found.end());
+    std::sort(expected.begin(), expected.end());
+    if(found != expected)
+        throw new std::runtime_error("Overlap queries do not match a linear scan");
+
+    loginfo << "Answered " << queries << " overlap queries over " << tree.size() << " intervals (" << found.size()
+        << " results) in " << treeTime << " seconds, vs. " << scanTime << " seconds with a linear scan" << endl;
+}
+
+template<class N, class T>
+bool AvlTests::avlCheckAugment(const N * root, const AvlIntervalAugment<T> *) const
+{
+    T maxHi = root->entry.key.hi;
+    for(int i = 0; i < 2; i++)
+        if(root->getChild(i) && maxHi < root->getChild(i)->maxHi)
+            maxHi = root->getChild(i)->maxHi;
+
+    if(root->maxHi != maxHi)
+    {
+        logerror << "Bad maximum endpoint at node " << root->entry.key << ": " << root->maxHi << " != " << maxHi << std::endl;
+        return false;
+    }
+
+    return true;
+}
+
+template<class N>
+bool AvlTests::avlCheckAugment(const N * root, const AvlSizeAugment *) const
+{
+    unsigned long size = 1 + AvlSizeAugment::size(root->getLeft()) + AvlSizeAugment::size(root->getRight());
+
+    if(root->subtreeSize != size)
+    {
+        logerror << "Bad subtree size at node " << root->entry.key << ": " << root->subtreeSize << " != " << size << std::endl;
+        return false;
+    }
+
+    return true;
+}
+
+template<class T, class N>
+bool AvlTests::avlCheckBST(const T& tree, const N * root, const N * min, const N * max, long& height, unsigned long& currTreeSize) const
 {
     if(root == NULL) {
         return true;
     }
     
     currTreeSize++;
-    const Node * left = root->getLeft();
-    const Node * right= root->getRight();
+    const N * left = root->getLeft();
+    const N * right= root->getRight();
 
     // Check BST invariant left_subtree(r) < r && right_subtree(r) > r
-    if(tree.lessThan(root, min) || tree.greaterThan(root, max)) {
+    if((min && tree.lessThan(root, min)) || (max && tree.greaterThan(root, max))) {
         logerror << "Found node in subtree that does not respect BST property" << endl;
         return false; 
     }
@@ -134,6 +1479,9 @@ bool AvlTests::avlCheckBST(const Tree& tree, const Node * root, const Node * min
             return false;
         }
     
+    if(!avlCheckAugment(root, root))
+        return false;
+
     // Check balance factors (stored vs. calculated) 
     int balance = root->balance;
     int absBalance = balance < 0 ? -balance : balance;
@@ -164,20 +1512,37 @@ bool AvlTests::avlCheckBST(const Tree& tree, const Node * root, const Node * min
     return passed;
 }
 
-bool AvlTests::testIntegrity(const Tree& tree) const
+template<class T>
+bool AvlTests::testIntegrity(const T& tree) const
 {
-    Node min(LONG_MIN, 0);
-    Node max(LONG_MAX, 0);
+    // No bounds on the root's subtree
+    decltype(tree.getRoot()) unbounded = NULL;
 
     unsigned long treeSize = 0;
     long h = 0;
-    bool passed = avlCheckBST(tree, tree.getRoot(), &min, &max, h, treeSize);
+    bool passed = avlCheckBST(tree, tree.getRoot(), unbounded, unbounded, h, treeSize);
 
     if(treeSize != tree.size()) {
         logerror << "Actual tree size of " <<  tree.size() << " nodes differs from computed one of " << treeSize << " nodes." << endl;
         passed = false;
     }
 
+    decltype(tree.getRoot()) leftmost = tree.getRoot(), rightmost = tree.getRoot();
+    while(leftmost && leftmost->getLeft())
+        leftmost = leftmost->getLeft();
+    while(rightmost && rightmost->getRight())
+        rightmost = rightmost->getRight();
+
+    if(leftmost != tree.getLeftmost() || rightmost != tree.getRightmost()) {
+        logerror << "Cached leftmost or rightmost node does not match the tree." << endl;
+        passed = false;
+    }
+
+    if(!tree.isBalanced()) {
+        logerror << "Tree still has inserts waiting to be rebalanced." << endl;
+        passed = false;
+    }
+
     if(h != tree.height()) {
         logerror << "avlCheckBST computed different height: " << h << " vs. real height of " << tree.height() << endl;
         passed = false;
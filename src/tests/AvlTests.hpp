@@ -7,6 +7,12 @@
 #include <Core.hpp>
 
 #include <AvlTree.hpp>
+#include <AvlMultiTree.hpp>
+#include <AvlDurableTree.hpp>
+#include <AvlIntervalTree.hpp>
+#include <AvlSmallTree.hpp>
+#include <AvlKeyPrefix.hpp>
+#include <AvlParallel.hpp>
 #include <AvlNode.hpp>
 
 #include <climits>
@@ -14,12 +20,22 @@
 #include <ctime>
 #include <cmath>
 #include <iostream>
+#include <map>
 #include <stdexcept>
+#include <string>
+#include <vector>
 
 using std::endl;
 
 typedef AvlNode<long, long> Node;
 typedef AvlTree<long, long> Tree;
+typedef AvlNode<long, long, AvlSizeAugment> SizeNode;
+typedef AvlTree<long, long, std::less<long>, AvlSizeAugment> SizeTree;
+typedef AvlDurableTree<long, long> DurableTree;
+typedef AvlIntervalTree<long, long> IntervalTree;
+typedef AvlSmallTree<long, long, 8> SmallTree;
+typedef AvlTree<std::string, long> StringTree;
+typedef AvlTree<AvlPrefixedKey<std::string>, long> PrefixedTree;
 
 class AvlTests
 {
@@ -39,12 +55,44 @@ class AvlTests
         void testHeight();
         void testRandomInserts();
         void testRemoves();
+        void testDuplicates();
+        void testHintedInserts();
+        void testDurability();
+        void testIntervals();
+        void testSmallTrees();
+        void testRelaxedBalance();
+        void testRelayout();
+        void testKeyPrefixes();
+        void testParallel();
+        void testPriorityQueue();
+        void testHotCache();
 
         void printTree(const Tree& tree, std::ostream& out, size_t maxDigits) const;
         void printInorder(const Tree& tree, std::ostream& out) const { avlPrintInorder(tree.getRoot(), out); }
     
     private:
-        bool testIntegrity(const Tree& tree) const;
+        void applyOps(DurableTree& tree, const std::vector<std::pair<bool, long> >& ops, unsigned long count) const;
+        void checkRecovered(DurableTree& tree, const std::vector<std::pair<bool, long> >& ops, unsigned long count) const;
+        void removeDir(const char * dir) const;
+        void checkHintedInserts(const char * name, const std::vector<long>& keys);
+        void checkHotCache(Tree& tree, const std::map<long, long>& expected) const;
+        template<class T>
+        void checkParallel(const char * name, unsigned long count);
+        template<class T>
+        double checkStringKeys(const std::vector<std::string>& keys);
+        template<class T>
+        void checkRemoves();
+        template<class T, class It>
+        bool sameKeys(const T& tree, It first, It last) const;
+        template<class T>
+        bool testIntegrity(const T& tree) const;
         void avlPrintInorder(const Node * root, std::ostream& out) const;
-        bool avlCheckBST(const Tree& tree, const Node * root, const Node * min, const Node * max, long& height, unsigned long& currTreeSize) const;
+        template<class T, class N>
+        bool avlCheckBST(const T& tree, const N * root, const N * min, const N * max, long& height, unsigned long& currTreeSize) const;
+        template<class N>
+        bool avlCheckAugment(const N *, const AvlNoAugment *) const { return true; }
+        template<class N>
+        bool avlCheckAugment(const N * root, const AvlSizeAugment *) const;
+        template<class N, class T>
+        bool avlCheckAugment(const N * root, const AvlIntervalAugment<T> *) const;
 };
@@ -47,6 +47,17 @@ int main(int argc, char * argv[])
         tester.testHeight();
         tester.testRandomInserts();
         tester.testRemoves();
+        tester.testDuplicates();
+        tester.testHintedInserts();
+        tester.testDurability();
+        tester.testIntervals();
+        tester.testSmallTrees();
+        tester.testRelaxedBalance();
+        tester.testRelayout();
+        tester.testKeyPrefixes();
+        tester.testParallel();
+        tester.testPriorityQueue();
+        tester.testHotCache();
 
         end = clock();
         double time = (double)(end - begin) / CLOCKS_PER_SEC;